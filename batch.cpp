@@ -0,0 +1,70 @@
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <algorithm>
+
+#include "batch.h"
+
+namespace {
+
+// Worlds waiting to be stepped. The owning thread takes from the back, so it
+// works through worlds in the order dealt; thieves take from the front.
+struct WorkQueue {
+  mutex m;
+  deque<int> worlds;
+
+  bool pop(int &wi) {
+    lock_guard<mutex> lock(m);
+    if (worlds.empty()) return false;
+    wi = worlds.back();
+    worlds.pop_back();
+    return true;
+  }
+
+  bool steal(int &wi) {
+    lock_guard<mutex> lock(m);
+    if (worlds.empty()) return false;
+    wi = worlds.front();
+    worlds.pop_front();
+    return true;
+  }
+};
+
+} // anonymous namespace
+
+void Batch::run(int steps, int nthreads) {
+  if (nthreads <= 0) nthreads = max(1u, thread::hardware_concurrency());
+  nthreads = min(nthreads, max(1, (int)worlds.size()));
+  results.resize(worlds.size());
+
+  // Deal contiguous blocks so neighbouring worlds share a thread
+  vector<WorkQueue> queues(nthreads);
+  for (int i = worlds.size()-1; i >= 0; --i) {
+    queues[(long)i * nthreads / worlds.size()].worlds.push_back(i);
+  }
+
+  // No work is added once started, so a thread is done when every queue is
+  // empty
+  auto worker = [&](int id) {
+    while (true) {
+      int wi;
+      bool found = queues[id].pop(wi);
+      for (int j = 1; !found && j < nthreads; ++j) {
+        found = queues[(id + j) % nthreads].steal(wi);
+      }
+      if (!found) return;
+
+      World *w = worlds[wi];
+      for (int s = 0; s < steps; ++s) {
+        w->step();
+      }
+      w->snapshot(results[wi]);
+    }
+  };
+
+  vector<thread> threads;
+  for (int t = 0; t < nthreads; ++t) {
+    threads.push_back(thread(worker, t));
+  }
+  for (thread &t : threads) t.join();
+}
@@ -0,0 +1,26 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "world.h"
+
+// Steps many small independent worlds (e.g. a parameter sweep) together in
+// one process. Worlds are dealt out to per-thread queues and idle threads
+// steal from the others, so uneven scenes still keep every core busy. Each
+// world runs all of its steps on one thread, with no barrier between worlds;
+// the parallelism is across worlds, not within one.
+struct Batch {
+  vector<World*> worlds; // Owned
+  vector< vector<BodyState> > results; // Final body states, per world
+
+  Batch() {}
+  Batch(const Batch&) = delete;
+  Batch& operator=(const Batch&) = delete;
+  ~Batch() {
+    for (World *w : worlds) delete w;
+  }
+
+  // Advance every world by steps timesteps. nthreads <= 0 uses all cores.
+  void run(int steps, int nthreads = 0);
+};
+
+#endif
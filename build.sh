@@ -1,8 +1,50 @@
 #!/bin/bash
 
-LINK="-lIrrlicht"
-SRCS="main.cpp types.cpp util.cpp"
+# Builds the physics core as librigidvoxels.a/.so, which has no renderer
+# dependency, then links the RigidVoxels app against it and irrlicht.
+# PRECISION=double builds the double variant of the core (see rvmath.h),
+# with every output suffixed _double.
+# COMPACT=1 adds the smaller particle encoding (see types.h), suffixed
+# _compact.
+# RigidVoxelsTest, which runs the reference scenarios (see regress.h), links
+# against the core alone and is always built.
+# CORE_ONLY=1 stops after the libraries and RigidVoxelsTest, for machines
+# without irrlicht.
+LINK="-lIrrlicht -pthread"
+CORE_SRCS="types.cpp util.cpp world.cpp scenario.cpp batch.cpp domain.cpp query.cpp realtime.cpp replay.cpp taskgraph.cpp constraint.cpp"
+SRCS="main.cpp regress.cpp"
+TEST_SRCS="regress_main.cpp regress.cpp"
 INC=""
 CPP_FLAGS="$1"
+SUFFIX=""
 
-g++ -std=c++11 ${CPP_FLAGS} ${INC} ${SRCS} ${LINK} -o RigidVoxels
+case "${PRECISION}" in
+  "" | float) ;;
+  double) CPP_FLAGS="${CPP_FLAGS} -DRV_DOUBLE"; SUFFIX="_double" ;;
+  *) echo "Unknown PRECISION ${PRECISION}" >&2; exit 1 ;;
+esac
+
+if [ -n "${COMPACT}" ]; then
+  CPP_FLAGS="${CPP_FLAGS} -DRV_COMPACT"
+  SUFFIX="${SUFFIX}_compact"
+fi
+
+OBJ_DIR="build${SUFFIX}"
+mkdir -p ${OBJ_DIR}
+OBJS=""
+for SRC in ${CORE_SRCS}; do
+  OBJ="${OBJ_DIR}/${SRC%.cpp}.o"
+  g++ -std=c++11 -fPIC ${CPP_FLAGS} ${INC} -c ${SRC} -o ${OBJ} || exit 1
+  OBJS="${OBJS} ${OBJ}"
+done
+rm -f librigidvoxels${SUFFIX}.a
+ar rcs librigidvoxels${SUFFIX}.a ${OBJS} || exit 1
+g++ -shared ${OBJS} -pthread -o librigidvoxels${SUFFIX}.so || exit 1
+
+g++ -std=c++11 ${CPP_FLAGS} ${INC} ${TEST_SRCS} librigidvoxels${SUFFIX}.a \
+    -pthread -o RigidVoxelsTest${SUFFIX} || exit 1
+
+if [ -z "${CORE_ONLY}" ]; then
+  g++ -std=c++11 ${CPP_FLAGS} ${INC} ${SRCS} librigidvoxels${SUFFIX}.a ${LINK} \
+      -o RigidVoxels${SUFFIX}
+fi
@@ -0,0 +1,111 @@
+#include <algorithm>
+
+#include "constraint.h"
+
+// Obj::w is integrated as a body frame rate, so spins and torques are moved
+// between frames here
+void Joint::apply() {
+  vec3 ra = a->toWorld(la);
+  vec3 rb = b->toWorld(lb);
+  vec3 wa = a->toWorld(a->w);
+  vec3 wb = b->toWorld(b->w);
+  vec3 d = (b->pos + rb) - (a->pos + ra);
+  vec3 dv = (b->v + wb.crossProduct(rb)) - (a->v + wa.crossProduct(ra));
+
+  // Force on a, pulling its anchor toward b's
+  vec3 spring;
+  vec3 f;
+  if (type == DISTANCE) {
+    real len = d.getLength();
+    if (len == 0) return; // No direction to push along
+    vec3 n = d / len;
+    spring = n * (k*(len - length));
+    f = spring + n * (eta*dv.dotProduct(n));
+  }
+  else {
+    spring = d * k;
+    f = spring + dv * eta;
+  }
+  if (breakForce > 0 && spring.getLength() > breakForce) {
+    broken = true;
+    return;
+  }
+
+  vec3 ta = ra.crossProduct(f);
+  vec3 tb = rb.crossProduct(-f);
+  if (type == HINGE) {
+    // Turn the axes toward each other, and damp relative spin about any
+    // other axis
+    vec3 ua = a->toWorld(axisA);
+    vec3 ub = b->toWorld(axisB);
+    vec3 dw = wb - wa;
+    vec3 t = ua.crossProduct(ub) * k + (dw - ua * dw.dotProduct(ua)) * eta;
+    ta += t;
+    tb -= t;
+  }
+
+  if (!a->fixed) {
+    a->f += f;
+    a->t += a->toLocal(ta);
+  }
+  if (!b->fixed) {
+    b->f -= f;
+    b->t += b->toLocal(tb);
+  }
+}
+
+void Joints::group() {
+  if (grouped && groupedCount == joints.size()) return;
+
+  // Batches in order of their first joint, each listing its joints in order
+  map< pair<Obj*,Obj*>, int > pairs;
+  vector< vector<int> > batches;
+  for (int i = 0; i < joints.size(); ++i) {
+    Obj *a = joints[i].a, *b = joints[i].b;
+    auto key = a < b ? make_pair(a, b) : make_pair(b, a);
+    auto it = pairs.find(key);
+    if (it == pairs.end()) {
+      it = pairs.insert(make_pair(key, (int)batches.size())).first;
+      batches.push_back(vector<int>());
+    }
+    batches[it->second].push_back(i);
+  }
+
+  // Greedy coloring: the lowest color neither moving body has yet
+  map< Obj*, vector<char> > used;
+  vector<int> color(batches.size());
+  int ncolors = 0;
+  for (int bi = 0; bi < batches.size(); ++bi) {
+    const Joint &j = joints[batches[bi][0]];
+    vector<char> *ua = j.a->fixed ? nullptr : &used[j.a];
+    vector<char> *ub = j.b->fixed ? nullptr : &used[j.b];
+    int c = 0;
+    while ((ua && c < ua->size() && (*ua)[c]) ||
+           (ub && c < ub->size() && (*ub)[c])) ++c;
+    for (vector<char> *u : {ua, ub}) {
+      if (!u) continue;
+      if (u->size() <= c) u->resize(c+1, 0);
+      (*u)[c] = 1;
+    }
+    color[bi] = c;
+    ncolors = max(ncolors, c+1);
+  }
+
+  // Lay batches out by color, keeping their order within one
+  vector<int> byColor(batches.size());
+  for (int bi = 0; bi < byColor.size(); ++bi) byColor[bi] = bi;
+  stable_sort(byColor.begin(), byColor.end(),
+              [&color](int x, int y) { return color[x] < color[y]; });
+  order.clear();
+  batchStart.assign(1, 0);
+  colorStart.assign(ncolors+1, 0);
+  for (int bi : byColor) {
+    order.insert(order.end(), batches[bi].begin(), batches[bi].end());
+    batchStart.push_back(order.size());
+    ++colorStart[color[bi]+1];
+  }
+  for (int c = 0; c < ncolors; ++c) colorStart[c+1] += colorStart[c];
+
+  grouped = true;
+  groupedCount = joints.size();
+}
@@ -0,0 +1,141 @@
+#ifndef CONSTRAINT_H
+#define CONSTRAINT_H
+
+#include "types.h"
+
+enum JointType {
+  DISTANCE, // Anchors held length apart
+  BALL, // Anchors held together
+  HINGE, // Anchors held together and axes held parallel
+};
+
+// A soft constraint between two bodies: a stiff damped spring between an
+// anchor on each, added to their forces after contact. Anchors and axes are
+// offsets in each body's frame, as part locs are. Steps are explicit and
+// bodies have unit mass, so the k of all joints on one body should stay well
+// below 2/ts^2, and their eta below 1/ts.
+struct Joint {
+  JointType type = BALL;
+  Obj *a = nullptr;
+  Obj *b = nullptr;
+  vec3 la, lb; // Anchors
+  vec3 axisA, axisB; // Hinge axis, unit length
+  real length = 0; // Rest length of a DISTANCE joint
+  real k = 20; // Spring, also per radian of hinge misalignment
+  real eta = 0.5; // Damping of the anchors' relative velocity
+  real breakForce = 0; // Spring force past which the joint breaks, 0 never
+  bool broken = false;
+
+  // Anchors at the world point at, on bodies in their current pose
+  static Joint ball(Obj *a, Obj *b, const vec3 &at) {
+    Joint j;
+    j.a = a;
+    j.b = b;
+    j.la = a->toLocal(at - a->pos);
+    j.lb = b->toLocal(at - b->pos);
+    return j;
+  }
+
+  // Hinge about the world axis through at
+  static Joint hinge(Obj *a, Obj *b, const vec3 &at, vec3 axis) {
+    Joint j = ball(a, b, at);
+    j.type = HINGE;
+    axis.normalize();
+    j.axisA = a->toLocal(axis);
+    j.axisB = b->toLocal(axis);
+    return j;
+  }
+
+  // Rest length is the current distance between the world points at and to
+  static Joint distance(Obj *a, Obj *b, const vec3 &at, const vec3 &to) {
+    Joint j;
+    j.type = DISTANCE;
+    j.a = a;
+    j.b = b;
+    j.la = a->toLocal(at - a->pos);
+    j.lb = b->toLocal(to - b->pos);
+    j.length = (to - at).getLength();
+    return j;
+  }
+
+  // Breakable bond between part pa of a and part pb of b, at their current
+  // distance. Bodies must have been pushed.
+  static Joint bond(Obj *a, int pa, Obj *b, int pb, real breakForce) {
+    Joint j;
+    j.type = DISTANCE;
+    j.a = a;
+    j.b = b;
+    j.la = a->loc(pa);
+    j.lb = b->loc(pb);
+    j.length = (b->parts[pb]->pos - a->parts[pa]->pos).getLength();
+    j.breakForce = breakForce;
+    return j;
+  }
+
+  // Add this joint's forces and torques to its bodies, except fixed ones,
+  // and break it if overloaded
+  void apply();
+};
+
+// The joints of a world, grouped so they can be applied in parallel. Joints
+// between the same two bodies form a batch, and batches are colored so no
+// two of one color share a moving body. Applying colors in order, and each
+// batch's joints in order, sums every body's forces in the same order
+// whatever the number of threads.
+struct Joints {
+  vector<Joint> joints;
+
+  void add(const Joint &j) {
+    joints.push_back(j);
+    grouped = false;
+  }
+
+  // Joints may also be pushed directly; group notices new ones. Fixed bodies
+  // are left out of coloring, so call regroup after changing which are.
+  void group();
+  void regroup() { grouped = false; }
+
+  int colors() const { return colorStart.size() - 1; }
+  // Batches of color c are [batchesOf(c).first, batchesOf(c).second)
+  pair<int,int> batchesOf(int c) const {
+    return make_pair(colorStart[c], colorStart[c+1]);
+  }
+  int batchSize(int b) const { return batchStart[b+1] - batchStart[b]; }
+
+  // Apply the joints of batches [begin, end)
+  void apply(int begin, int end) {
+    for (int i = batchStart[begin]; i < batchStart[end]; ++i) {
+      Joint &j = joints[order[i]];
+      if (!j.broken) j.apply();
+    }
+  }
+
+  // Every color in order, on the calling thread
+  void apply() {
+    group();
+    for (int c = 0; c < colors(); ++c) {
+      apply(colorStart[c], colorStart[c+1]);
+    }
+  }
+
+  int broken() const {
+    int n = 0;
+    for (const Joint &j : joints) n += j.broken;
+    return n;
+  }
+
+  size_t bytes() const {
+    return joints.capacity()*sizeof(Joint) +
+        (order.capacity() + batchStart.capacity() + colorStart.capacity()) *
+        sizeof(int);
+  }
+
+private:
+  bool grouped = false;
+  size_t groupedCount = 0;
+  vector<int> order; // Joint indices, by batch
+  vector<int> batchStart; // Into order, one past the end last
+  vector<int> colorStart = vector<int>(1, 0); // Into batches, likewise
+};
+
+#endif
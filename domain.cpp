@@ -0,0 +1,335 @@
+#include <thread>
+#include <cstring>
+#include <algorithm>
+
+#include "domain.h"
+
+namespace {
+
+enum Tag {
+  PARTS = 1,
+  FORCES,
+  BODIES,
+};
+
+// Plain-data (de)serialization of message payloads
+struct Writer {
+  vector<char> &buf;
+  Writer(vector<char> &buf) : buf(buf) {}
+  template<class T> void put(const T &v) {
+    const char *p = (const char*)&v;
+    buf.insert(buf.end(), p, p + sizeof(T));
+  }
+};
+
+struct Reader {
+  const vector<char> &buf;
+  size_t at = 0;
+  Reader(const vector<char> &buf) : buf(buf) {}
+  bool done() { return at >= buf.size(); }
+  template<class T> T get() {
+    T v;
+    memcpy(&v, &buf[at], sizeof(T));
+    at += sizeof(T);
+    return v;
+  }
+};
+
+} // anonymous namespace
+
+void LocalTransport::send(int dst, int tag, const vector<char> &data) {
+  LocalHub::Mailbox &box = hub->boxes[dst];
+  {
+    lock_guard<mutex> lock(box.m);
+    box.msgs.push_back({r, tag, data});
+  }
+  box.cv.notify_all();
+}
+
+void LocalTransport::recv(int src, int tag, vector<char> &data) {
+  LocalHub::Mailbox &box = hub->boxes[r];
+  unique_lock<mutex> lock(box.m);
+  while (true) {
+    for (auto it = box.msgs.begin(); it != box.msgs.end(); ++it) {
+      if (it->src == src && it->tag == tag) {
+        data.swap(it->data);
+        box.msgs.erase(it);
+        return;
+      }
+    }
+    box.cv.wait(lock);
+  }
+}
+
+// Slab boundaries are snapped to voxel boundaries, so that every cell a rank
+// looks at holds either all of its particles or none
+int DomainRank::cellOf(double x) const {
+  return (int)floor((x - vox.xbase) / vox.size);
+}
+
+int DomainRank::slabOf(double x) const {
+  int s = (int)floor((double)(cellOf(x) - cellOf(lo)) / slabCells());
+  return max(0, min(comm->size() - 1, s));
+}
+
+int DomainRank::slabCells() const {
+  return max(1, (int)round(width / vox.size));
+}
+
+// Send one buffer to every rank (including this one) and receive one back
+// from each, in rank order
+void DomainRank::exchange(int tag, const vector< vector<char> > &out,
+                          vector< vector<char> > &in) {
+  int n = comm->size();
+  for (int r = 0; r < n; ++r) {
+    comm->send(r, tag, out[r]);
+  }
+  in.resize(n);
+  for (int r = 0; r < n; ++r) {
+    comm->recv(r, tag, in[r]);
+  }
+}
+
+// Push owned bodies and ship each particle to the slab it lies in, plus the
+// neighbouring slab if within ghost range of the boundary. Receivers rebuild
+// them as proxy bodies carrying the owner's center for torques.
+void DomainRank::routeParticles() {
+  int n = comm->size();
+  // Two cells of ghosts covers the neighbour search of every cell that can
+  // hold one particle of a boundary pair
+  const int ghost = 2;
+  vector< vector<char> > out(n), in;
+  vector< vector<int> > perDst(n);
+  for (Obj *o : owned) {
+    o->clearStepVals();
+    o->f = gravity;
+    o->push();
+    for (vector<int> &d : perDst) d.clear();
+    for (Particle *p : o->parts) {
+      int s = slabOf(p->pos.X);
+      int c = cellOf(p->pos.X) - cellOf(lo) - s*slabCells();
+      perDst[s].push_back(p->index);
+      if (s > 0 && c < ghost) {
+        perDst[s-1].push_back(p->index);
+      }
+      if (s < n-1 && c >= slabCells() - ghost) {
+        perDst[s+1].push_back(p->index);
+      }
+    }
+    for (int r = 0; r < n; ++r) {
+      if (perDst[r].empty()) continue;
+      Writer w(out[r]);
+      w.put(o->id);
+      w.put(o->pos);
+#ifdef RV_COMPACT
+      w.put(o->v);
+      w.put(o->w);
+#endif
+      w.put(o->fixed);
+      w.put((int)perDst[r].size());
+      for (int i : perDst[r]) {
+        w.put(i);
+        w.put(o->parts[i]->pos);
+#ifndef RV_COMPACT
+        w.put(o->parts[i]->v);
+#endif
+      }
+    }
+  }
+  exchange(PARTS, out, in);
+
+  for (Obj *o : proxies) delete o;
+  proxies.clear();
+  for (int r = 0; r < n; ++r) {
+    Reader rd(in[r]);
+    while (!rd.done()) {
+      Obj *proxy = new Obj();
+      proxy->id = rd.get<int>();
+      proxy->pos = rd.get<vec3>();
+#ifdef RV_COMPACT
+      proxy->v = rd.get<vec3>();
+      proxy->w = rd.get<vec3>();
+#endif
+      proxy->fixed = rd.get<bool>();
+      int count = rd.get<int>();
+      for (int i = 0; i < count; ++i) {
+        Particle *p = new Particle();
+        p->parent = proxy;
+        p->index = rd.get<int>();
+        p->pos = rd.get<vec3>();
+#ifndef RV_COMPACT
+        p->v = rd.get<vec3>();
+#endif
+        proxy->parts.push_back(p);
+      }
+      proxies.push_back(proxy);
+    }
+  }
+  // Bin in body order like World::step, since which particle of a pair
+  // comes first affects the contact force
+  sort(proxies.begin(), proxies.end(),
+       [](const Obj *a, const Obj *b) { return a->id < b->id; });
+}
+
+// Send the force and torque accumulated on each proxy back to its owner
+void DomainRank::reduceForces() {
+  int n = comm->size();
+  vector< vector<char> > out(n), in;
+  // Owner of a proxy is the sender of its particles, which is the slab of
+  // the body center as of the start of the step
+  for (Obj *proxy : proxies) {
+    if (proxy->f.getLengthSQ() == 0 && proxy->t.getLengthSQ() == 0) continue;
+    Writer w(out[slabOf(proxy->pos.X)]);
+    w.put(proxy->id);
+    w.put(proxy->f);
+    w.put(proxy->t);
+  }
+  exchange(FORCES, out, in);
+
+  map<int, Obj*> byId;
+  for (Obj *o : owned) byId[o->id] = o;
+  for (int r = 0; r < n; ++r) {
+    Reader rd(in[r]);
+    while (!rd.done()) {
+      Obj *o = byId[rd.get<int>()];
+      o->f += rd.get<vec3>();
+      o->t += rd.get<vec3>();
+    }
+  }
+}
+
+// Hand bodies whose center left this slab to their new owner
+void DomainRank::migrate() {
+  int n = comm->size();
+  vector< vector<char> > out(n), in;
+  vector<Obj*> keep;
+  for (Obj *o : owned) {
+    int s = slabOf(o->pos.X);
+    if (s == comm->rank()) {
+      keep.push_back(o);
+      continue;
+    }
+    Writer w(out[s]);
+    w.put(o->id);
+    w.put(o->pos);
+    w.put(o->v);
+    w.put(o->theta);
+    w.put(o->w);
+    w.put(o->fixed);
+    if (bodies) continue;
+    w.put((int)o->locs.size());
+    for (int i = 0; i < o->locs.size(); ++i) w.put(o->loc(i));
+    delete o;
+  }
+  owned.swap(keep);
+  exchange(BODIES, out, in);
+
+  for (int r = 0; r < n; ++r) {
+    Reader rd(in[r]);
+    while (!rd.done()) {
+      // In process the state lands back in the body it came from
+      int id = rd.get<int>();
+      Obj *o = bodies ? (*bodies)[id] : new Obj();
+      o->id = id;
+      o->pos = rd.get<vec3>();
+      o->v = rd.get<vec3>();
+      o->theta = rd.get<quat>();
+      o->w = rd.get<vec3>();
+      o->fixed = rd.get<bool>();
+      if (!bodies) {
+        int count = rd.get<int>();
+        o->reserve(count);
+        for (int i = 0; i < count; ++i) o->addPart(rd.get<vec3>());
+      }
+      owned.push_back(o);
+    }
+  }
+}
+
+void DomainRank::step() {
+  routeParticles();
+
+  vox.clear();
+  for (Obj *o : proxies) {
+    o->dumpIntoVoxels(vox);
+  }
+  for (Plane *p : planes) {
+    p->dumpIntoVoxels(vox);
+  }
+
+  // Only evaluate contacts this rank is responsible for, so pairs straddling
+  // a boundary are counted once
+  vector<Collision> cs;
+  vox.findCollisions(cs);
+  Collision::sortCanonical(cs);
+  for (Collision &c : cs) {
+    int s1 = c.o1->getType() == PART ? slabOf(c.o1->pos.X) : comm->size();
+    int s2 = c.o2->getType() == PART ? slabOf(c.o2->pos.X) : comm->size();
+    if (min(s1, s2) != comm->rank()) continue;
+    c.applyForces(params);
+  }
+
+  reduceForces();
+
+  for (Obj *o : owned) {
+    o->integrateForce(ts);
+    o->integrateVel(ts);
+  }
+
+  migrate();
+}
+
+Decomposition::Decomposition(int nranks, double lo, double width)
+    : nranks(nranks), lo(lo), width(width), hub(nranks), ranks(nranks),
+      pool(nranks) {
+  for (int r = 0; r < nranks; ++r) {
+    comms.push_back(LocalTransport(&hub, r));
+  }
+  for (int r = 0; r < nranks; ++r) {
+    ranks[r].comm = &comms[r];
+    ranks[r].lo = lo;
+    ranks[r].width = width;
+  }
+}
+
+// The world owns the bodies
+Decomposition::~Decomposition() {
+  for (DomainRank &dr : ranks) dr.owned.clear();
+}
+
+void Decomposition::step(World &world, int steps) {
+  for (DomainRank &dr : ranks) {
+    dr.ts = world.ts;
+    dr.params = world.params;
+    dr.gravity = world.gravity;
+    dr.planes = world.planes;
+    dr.bodies = &world.objects;
+    dr.owned.clear();
+  }
+
+  // Hand the world's bodies to their owning ranks
+  for (int i = 0; i < world.objects.size(); ++i) {
+    Obj *o = world.objects[i];
+    o->id = i;
+    ranks[ranks[0].slabOf(o->pos.X)].owned.push_back(o);
+  }
+  for (int i = 0; i < world.planes.size(); ++i) {
+    world.planes[i]->id = i;
+  }
+
+  // One task per rank on a pool of as many threads, so all run at once
+  TaskGraph g;
+  for (int r = 0; r < nranks; ++r) {
+    g.add([this, r, steps] {
+      for (int s = 0; s < steps; ++s) {
+        ranks[r].step();
+      }
+    });
+  }
+  pool.run(g);
+}
+
+void runDecomposed(World &world, int nranks, double lo, double width,
+                   int steps) {
+  Decomposition(nranks, lo, width).step(world, steps);
+}
@@ -0,0 +1,126 @@
+#ifndef DOMAIN_H
+#define DOMAIN_H
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+#include "world.h"
+
+// Point-to-point messaging between ranks, modelled on MPI send/recv. Sends
+// never block; recv blocks until a message from src with tag arrives, and
+// messages with the same src and tag arrive in order.
+struct Transport {
+  virtual ~Transport() {}
+  virtual int rank() = 0;
+  virtual int size() = 0;
+  virtual void send(int dst, int tag, const vector<char> &data) = 0;
+  virtual void recv(int src, int tag, vector<char> &data) = 0;
+};
+
+// Mailboxes shared by ranks running as threads of one process
+struct LocalHub {
+  struct Msg {
+    int src;
+    int tag;
+    vector<char> data;
+  };
+  struct Mailbox {
+    mutex m;
+    condition_variable cv;
+    deque<Msg> msgs;
+  };
+  vector<Mailbox> boxes; // One per destination rank
+
+  LocalHub(int n) : boxes(n) {}
+};
+
+struct LocalTransport : Transport {
+  LocalHub *hub;
+  int r;
+
+  LocalTransport(LocalHub *hub, int r) : hub(hub), r(r) {}
+
+  int rank() { return r; }
+  int size() { return hub->boxes.size(); }
+  void send(int dst, int tag, const vector<char> &data);
+  void recv(int src, int tag, vector<char> &data);
+};
+
+// One rank of a world split into slabs along X. Slab r covers
+// [lo + r*width, lo + (r+1)*width), rounded to whole voxels, with the outer
+// slabs unbounded. Each rank owns the bodies whose center lies in its slab.
+// Every step, owners route particles to the slab they lie in, plus a ghost
+// copy to the neighbouring slab when within two cells of the boundary.
+// Contacts are evaluated once, by the lower of the two particles' slabs, and
+// partial forces on each body are reduced at its owner, which integrates and
+// hands the body over if it has crossed into another slab.
+struct DomainRank {
+  Transport *comm;
+  double lo;
+  double width;
+
+  double ts = 0.03;
+  Params params;
+  vec3 gravity;
+  vector<Plane*> planes; // Replicated on every rank, not owned
+  vector<Obj*> owned;
+  // All bodies by id, when every rank shares this process. Bodies changing
+  // rank then hand over just their id and are not reallocated, so pointers
+  // to them stay valid; otherwise they are rebuilt from their particles.
+  const vector<Obj*> *bodies = nullptr;
+
+  DomainRank() {}
+  DomainRank(const DomainRank&) = delete;
+  DomainRank& operator=(const DomainRank&) = delete;
+  ~DomainRank() {
+    for (Obj *o : owned) delete o;
+    for (Obj *o : proxies) delete o;
+  }
+
+  int slabOf(double x) const;
+  void step();
+
+private:
+  int cellOf(double x) const;
+  int slabCells() const;
+
+  Voxels vox;
+  vector<Obj*> proxies; // Per-step copies of the particles in this slab
+
+  void exchange(int tag, const vector< vector<char> > &out,
+                vector< vector<char> > &in);
+  void routeParticles();
+  void reduceForces();
+  void migrate();
+};
+
+// A world split into nranks slabs that stays up across steps: the ranks
+// with their grids, a LocalTransport between them and a thread per rank.
+// Each call deals the world's bodies to their owners, so the world may change
+// in between. Bodies stay where they are in memory and in world.objects.
+struct Decomposition {
+  const int nranks;
+  const double lo;
+  const double width;
+
+  Decomposition(int nranks, double lo, double width);
+  Decomposition(const Decomposition&) = delete;
+  Decomposition& operator=(const Decomposition&) = delete;
+  ~Decomposition();
+
+  // Run steps of world. Joints and CCD are left out (see World::ranks).
+  void step(World &world, int steps = 1);
+
+private:
+  LocalHub hub;
+  vector<LocalTransport> comms;
+  vector<DomainRank> ranks;
+  TaskPool pool;
+};
+
+// Run steps of world on a Decomposition made for just this call
+void runDecomposed(World &world, int nranks, double lo, double width,
+                   int steps);
+
+#endif
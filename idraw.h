@@ -4,6 +4,9 @@
 #include <irrlicht/irrlicht.h>
 
 #include "types.h"
+#include "realtime.h"
+
+// Renderer adapter: mirrors core objects into an irrlicht scene
 
 // Pull in irr::* namespaces
 using namespace irr;
@@ -20,22 +23,34 @@ IVideoDriver *driver;
 ISceneManager *smgr;
 IGUIEnvironment *guienv;
 
+// The core may run in double, irrlicht is float only
+vector3df toIrr(const vec3 &v) {
+  return vector3df(v.X, v.Y, v.Z);
+}
+
 struct IrrObj {
   Obj* parent;
   IMeshSceneNode* node;
   vector<IMeshSceneNode*> parts;
 
-  void updatePos() {
-    node->setPosition(parent->pos);
+  // Pose blended between two published states. Only reads parent's local
+  // part offsets, which the simulation thread never changes.
+  void updatePos(const BodyState &a, const BodyState &b, real alpha) {
+    vec3 pos = a.pos + (b.pos - a.pos)*alpha;
+    quat q;
+    q.slerp(a.theta, b.theta, alpha);
+    node->setPosition(toIrr(pos));
     vector3df euler;
-    parent->theta.toEuler(euler);
+    quaternion(q.X, q.Y, q.Z, q.W).toEuler(euler);
     node->setRotation(euler*RADTODEG);
-    
-    assert(parent->parts.size() == parts.size());
+
+    assert(parent->locs.size() == parts.size());
+    quat qInv = q;
+    qInv.makeInverse();
     for (int i = 0; i < parts.size(); ++i) {
-      IMeshSceneNode* mn = parts[i];
-      Particle* part = parent->parts[i];
-      mn->setPosition(part->pos);
+      vec3 l = parent->loc(i);
+      quat r = qInv*quat(l.X, l.Y, l.Z, 0)*q;
+      parts[i]->setPosition(toIrr(pos + vec3(r.X, r.Y, r.Z)));
     }
   }
 };
@@ -87,13 +102,35 @@ int addObj(Obj* obj) {
     IMeshSceneNode *mn = smgr->addSphereSceneNode(PART_D/2/*radius*/);
     io.parts.push_back(mn);
   }
-  io.updatePos();
+  BodyState s = {obj->pos, obj->v, obj->theta, obj->w};
+  io.updatePos(s, s, 0);
   objects.push_back(io);
 }
 
-int step() {
-  for (IrrObj &io : objects) {
-    io.updatePos();
+// Planes are drawn as a static grid of small spheres
+void addPlane(Plane* plane) {
+  vec3 up = plane->norm.crossProduct(plane->right);
+
+  double size = PART_D/2;
+
+  int ni = plane->width/2/size;
+  int nj = plane->height/2/size;
+  for (int i = -ni - 1; i <= ni; i++) {
+    for (int j = -nj - 1; j <= nj; j++) {
+      vec3 c = (plane->pos/size + up*i + plane->right*j) * size;
+      smgr->addSphereSceneNode(PART_D/4)->setPosition(toIrr(c));
+    }
+  }
+}
+
+// Draw one frame, alpha of the way from f.prev to f.cur. Call from the thread
+// that ran init.
+int step(const Frame &f, real alpha) {
+  if (f.time >= 0) {
+    assert(f.cur.size() == objects.size());
+    for (int i = 0; i < objects.size(); ++i) {
+      objects[i].updatePos(f.prev[i], f.cur[i], alpha);
+    }
   }
 
   if (dev->run()) {
@@ -4,15 +4,21 @@
 #include <cmath>
 #include <map>
 #include <unistd.h>
+#include <thread>
 
 #include "types.h"
+#include "world.h"
+#include "scenario.h"
+#include "batch.h"
+#include "realtime.h"
+#include "replay.h"
+#include "regress.h"
 
 // Drawing
 #include "vdb.h"
 #include "idraw.h"
 
 using namespace std;
-using namespace irr::core;
 
 // Draw backend options
 enum Draw { Vdb, Irr };
@@ -26,11 +32,173 @@ void ln(double x, double y, double z,
   vdb_line(x,y,z,x2,y2,z2);
 }
 
-bool fc(double f1, double f2) {
-  return fabs(f1-f2) < 0.0001;
+// Drop o1 onto o2 (1-part each)
+void defaultScene(World &world) {
+  Obj *o1 = new Obj(), *o2 = new Obj(), *o3 = new Obj(), *o4 = new Obj();
+  o1->addPart(vec3(0,0.5,0));
+  o1->addPart(vec3(0,-0.5,0));
+  o1->theta.fromAngleAxis(M_PI/2, vec3(1,0,0)); // 90 degrees about x axis
+  o1->pos.Y = 3.0;
+  o1->v.Y = -1.0;
+
+  o2->addPart(vec3(0,0.5,0));
+  o2->addPart(vec3(0,-0.5,0));
+  o2->pos.Z = 0.5;
+  o2->fixed = true;
+
+  o3->addPart(vec3(0,0.5,0));
+  o3->addPart(vec3(0,-0.5,0));
+  o3->theta.fromAngleAxis(M_PI/4, vec3(0,0,1)); // 45 degrees about z axis
+  o3->pos.Y = 2.0;
+  o3->v.Y = -0.5;
+
+  o4->addPart(vec3(0,0.5,0));
+  o4->addPart(vec3(0,-0.5,0));
+  o4->theta.fromAngleAxis(-M_PI/4, vec3(0,0,1)); // -45 degrees about z axis
+  o4->pos.Y = 4.0;
+  o4->v.Y = 0.0;
+  o4->v.X = -1.0;
+
+  world.objects = {o1, o2, o3, o4};
+
+  Plane *plane1 = new Plane();
+  plane1->width = 6.0;
+  plane1->height = 6.0;
+  plane1->norm = vec3(-1,0,0);
+  plane1->right = vec3(0, 1 ,0);
+  plane1->pos = vec3(-3,2,0);
+
+  Plane *plane2 = new Plane();
+  plane2->width = 6.0;
+  plane2->height = 6.0;
+  plane2->norm = vec3(0,1,0);
+  plane2->right = vec3(1, 0 ,0);
+  plane2->pos = vec3(0,-2,0);
+
+  world.planes = {plane1, plane2};
+}
+
+// Sweep the spring constant over copies of one scenario, from half to one and
+// a half times its value: batch <scenario> <worlds> <steps>
+int runBatch(int argc, char** argv) {
+  if (argc < 5) {
+    cerr << "Usage: " << argv[0] << " batch <scenario> <worlds> <steps>"
+         << endl;
+    return 1;
+  }
+  int n = atoi(argv[3]);
+  int steps = atoi(argv[4]);
+  Batch batch;
+  for (int i = 0; i < n; ++i) {
+    World *w = new World();
+    batch.worlds.push_back(w);
+    int err = loadScenario(argv[2], *w);
+    if (err) return err;
+    w->params.k *= 0.5 + (n > 1 ? (double)i / (n-1) : 0.5);
+  }
+  batch.run(steps);
+  for (int i = 0; i < n; ++i) {
+    cout << "world " << i << " k=" << batch.worlds[i]->params.k;
+    for (const BodyState &b : batch.results[i]) {
+      cout << " " << b.pos;
+    }
+    cout << endl;
+  }
+  return 0;
+}
+
+// Hash every step of a scenario, or check a run against such a recording:
+// record|verify <scenario> <steps> <hashfile> [ranks] [threads]
+// With ranks > 1 the world is stepped decomposed into that many X slabs,
+// with CCD off as decomposed steps require (and no joints, which they lack),
+// otherwise on threads threads.
+int runReplay(int argc, char** argv) {
+  if (argc < 5) {
+    cerr << "Usage: " << argv[0]
+         << " record|verify <scenario> <steps> <hashfile> [ranks] [threads]"
+         << endl;
+    return 1;
+  }
+  World world;
+  int err = loadScenario(argv[2], world);
+  if (err) return err;
+  int steps = atoi(argv[3]);
+
+  Backend be;
+  if (argc > 5) be.ranks = atoi(argv[5]);
+  if (argc > 6) be.threads = atoi(argv[6]);
+  if (be.ranks > 1 && !world.joints.joints.empty()) {
+    cerr << argv[2] << " has joints, which decomposed steps do not support"
+         << endl;
+    return 1;
+  }
+  if (be.ranks > 1) world.ccd = false;
+
+  // Slabs evenly over the bodies' X extent
+  if (be.ranks > 1 && !world.objects.empty()) {
+    double lo = world.objects[0]->pos.X, hi = lo;
+    for (Obj *o : world.objects) {
+      lo = min(lo, (double)o->pos.X);
+      hi = max(hi, (double)o->pos.X);
+    }
+    be.lo = lo;
+    be.width = max((hi - lo) / be.ranks, 1.0);
+  }
+
+  if (strcmp(argv[1], "record") == 0) {
+    return recordHashes(world, steps, be, argv[4]);
+  }
+  return verifyHashes(world, steps, be, argv[4]);
+}
+
+// Report memory use per particle and per body after a few steps:
+// stats <scenario> [steps]
+int runStats(int argc, char** argv) {
+  if (argc < 3) {
+    cerr << "Usage: " << argv[0] << " stats <scenario> [steps]" << endl;
+    return 1;
+  }
+  World world;
+  int err = loadScenario(argv[2], world);
+  if (err) return err;
+  int steps = argc > 3 ? atoi(argv[3]) : 1;
+  for (int i = 0; i < steps; ++i) world.step();
+
+  Footprint fp = world.footprint();
+  size_t total = fp.bodyBytes + fp.partBytes + fp.gridBytes + fp.sceneBytes;
+  cout << fp.bodies << " bodies, " << fp.parts << " particles, "
+       << total / (1 << 20) << " MB" << endl;
+  cout << "  per particle: " << (double)fp.partBytes / max<size_t>(fp.parts, 1)
+       << " B, plus " << (double)fp.gridBytes / max<size_t>(fp.parts, 1)
+       << " B of grid" << endl;
+  cout << "  per body: " << (double)fp.bodyBytes / max<size_t>(fp.bodies, 1)
+       << " B" << endl;
+  cout << "  sizeof Particle " << sizeof(Particle) << ", Obj " << sizeof(Obj)
+       << endl;
+  return 0;
+}
+
+// Check the analytic reference scenarios, serially and, if given more than
+// one, on that many threads: regress [threads]. Returns 1 if any check fails.
+int runRegress(int argc, char** argv) {
+  return reportRegressions(argc > 2 ? atoi(argv[2]) : 1);
 }
 
 int main(int argc, char** argv) {
+  if (argc > 1 && strcmp(argv[1], "batch") == 0) {
+    return runBatch(argc, argv);
+  }
+  if (argc > 1 && (strcmp(argv[1], "record") == 0 ||
+                   strcmp(argv[1], "verify") == 0)) {
+    return runReplay(argc, argv);
+  }
+  if (argc > 1 && strcmp(argv[1], "stats") == 0) {
+    return runStats(argc, argv);
+  }
+  if (argc > 1 && strcmp(argv[1], "regress") == 0) {
+    return runRegress(argc, argv);
+  }
+
   Draw draw = Draw::Vdb;
   if (argc > 1) {
     if (strcmp(argv[1], "vdb") == 0) {
@@ -48,6 +216,7 @@ int main(int argc, char** argv) {
   else {
     cout << "Using vdb draw backend by default." << endl;
   }
+  // Optional second arg is a scenario file, see scenario.cpp for the format
 
   // Init drawing
   if (draw == Draw::Irr) {
@@ -58,159 +227,54 @@ int main(int argc, char** argv) {
     }
   }
 
-  // Test position pushing
-  // Obj o1, o2;
-  // o1.addPart(0.0, 0.0);
-  // o2.addPart(1.0, 1.0);
-
-  // o1.x = 1.0;
-  // o1.y = 2.0;
-  // o1.push();
-  // assert(o1.parts[0]->x == 1.0);
-  // assert(o1.parts[0]->y == 2.0);
-  // assert(o1.parts[0]->vx == 0.0);
-  // assert(o1.parts[0]->vy == 0.0);
-
-  // o1.vx = 3.0;
-  // o1.vy = 4.0;
-  // o1.push();
-  // assert(o1.parts[0]->x == 1.0);
-  // assert(o1.parts[0]->y == 2.0);
-  // assert(o1.parts[0]->vx == 3.0);
-  // assert(o1.parts[0]->vy == 4.0);
-
-  // o2.x = 1.0;
-  // o2.y = 2.0;
-  // o2.theta = M_PI/2.0;
-  // o2.push();
-  // assert(o2.parts[0]->x == 0.0);
-  // assert(o2.parts[0]->y == 3.0);
-
-  // o2.w = 1.0;
-  // o2.push();
-  // assert(o2.parts[0]->x == 0.0);
-  // assert(o2.parts[0]->y == 3.0);
-  // assert(fc(o2.parts[0]->vx, -1.0));
-  // assert(fc(o2.parts[0]->vy, -1.0));
-
-
-  // Drop o1 onto o2 (1-part each)
-  Obj o1, o2, o3, o4;
-  o1.addPart(vector3df(0,0.5,0));
-  o1.addPart(vector3df(0,-0.5,0));
-  o1.theta.fromAngleAxis(M_PI/2, vector3df(1,0,0)); // 90 degrees about x axis
-  o1.pos.Y = 3.0;
-  o1.v.Y = -1.0;
-
-  o2.addPart(vector3df(0,0.5,0));
-  o2.addPart(vector3df(0,-0.5,0));
-  o2.pos.Z = 0.5;
-  o2.fixed = true;
-
-  o3.addPart(vector3df(0,0.5,0));
-  o3.addPart(vector3df(0,-0.5,0));
-  o3.theta.fromAngleAxis(M_PI/4, vector3df(0,0,1)); // 45 degrees about z axis
-  o3.pos.Y = 2.0;
-  o3.v.Y = -0.5;
-
-  o4.addPart(vector3df(0,0.5,0));
-  o4.addPart(vector3df(0,-0.5,0));
-  o4.theta.fromAngleAxis(-M_PI/4, vector3df(0,0,1)); // -45 degrees about z axis
-  o4.pos.Y = 4.0;
-  o4.v.Y = 0.0;
-  o4.v.X = -1.0;
-
-  vector<Obj*> objects = {&o1, &o2, &o3, &o4};
-
-  Plane plane1;
-  plane1.width = 6.0;
-  plane1.height = 6.0;
-  plane1.norm = vector3df(-1,0,0);
-  plane1.right = vector3df(0, 1 ,0);
-  plane1.pos = vector3df(-3,2,0);
-
-  Plane plane2;
-  plane2.width = 6.0;
-  plane2.height = 6.0;
-  plane2.norm = vector3df(0,1,0);
-  plane2.right = vector3df(1, 0 ,0);
-  plane2.pos = vector3df(0,-2,0);
-
-  vector<Plane*> planes = {&plane1, &plane2};
+  World world;
+  if (argc > 2) {
+    int err = loadScenario(argv[2], world);
+    if (err) return err;
+    cout << "Loaded " << world.objects.size() << " objects from "
+         << argv[2] << endl;
+  }
+  else {
+    defaultScene(world);
+  }
 
   // Add objects to draw backend
   if (draw == Draw::Irr) {
-    for (Obj* o : objects) {
+    for (Obj* o : world.objects) {
       idraw::addObj(o);
     }
+    for (Plane * p : world.planes) {
+      idraw::addPlane(p);
+    }
   }
 
-  for (Plane * p : planes) {
-    p->addToScene(smgr);
-  }
-
-
-  Voxels v;
-
-  const double ts = 0.03;
-
   // LOOP
-  int iter = 0;
-  while (true) {
-    // usleep(10000);
-
-    // Step 0: Init objs
-    v.voxels.clear();
-    for (Obj* o : objects) {
-      o->clearStepVals();
-    }
-
-    // Step 1: Push obj state into particles
-    for (Obj* o : objects) {
-      o->push();
-    }
-
-    // Step 2: Run through particles and stick into voxels
-    for (Obj* o : objects) {
-      o->dumpIntoVoxels(v);
-    }
-
-    for (Plane* p : planes) {
-      p->dumpIntoVoxels(v);
-    }
-    // Step 3: Detect collisions, compute forces, add these to object
-    vector<Collision> cs;
-    v.findCollisions(cs);
-    for (Collision &c : cs) {
-      c.applyForces();
-    }
-
-    // Step 4: Integrate forces
-    for (Obj* o : objects) {
-      o->integrateForce(ts);
-    }
-
-    // Step 5: Integrate velocities
-    for (Obj* o : objects) {
-      o->integrateVel(ts);
-    }
-
-
-    // Draw
-    if (draw == Draw::Vdb) {
+  if (draw == Draw::Vdb) {
+    int iter = 0;
+    vector< vector<vec3> > trails(world.objects.size());
+    while (true) {
+      world.step();
       if (iter % 10 == 0) {
-        for (Obj* o : objects) {
-          o->push();
-          o->draw(iter/10.0, &pt, &ln);
+        for (int i = 0; i < world.objects.size(); ++i) {
+          Obj* o = world.objects[i];
+          o->push(); // step skips culled bodies
+          o->draw(trails[i], iter/10.0, &pt, &ln);
         }
       }
+      ++iter;
     }
-    else if (draw == Draw::Irr) {
-      int ret = idraw::step();
+  }
+  else if (draw == Draw::Irr) {
+    // Physics runs at a fixed rate on its own thread; this one only draws
+    RealtimeLoop loop(world);
+    thread sim([&loop]() { loop.run(); });
+    while (true) {
+      const Frame &f = loop.frames.read();
+      int ret = idraw::step(f, loop.blend(f, loop.elapsed()));
       if (ret) break;
     }
-
-    ++iter;
+    loop.quit = true;
+    sim.join();
   }
 
   // Cleanup
@@ -0,0 +1,264 @@
+#include <thread>
+#include <limits>
+#include <algorithm>
+
+#include "query.h"
+
+namespace {
+
+const double R = PART_D/2; // Particle radius
+
+// Distance along the ray to within r of c, or -1 on a miss. dir is unit
+// length.
+double raySphere(const vec3 &from, const vec3 &dir,
+                 const vec3 &c, double r) {
+  vec3 oc = from - c;
+  double b = oc.dotProduct(dir);
+  double cc = oc.getLengthSQ() - r*r;
+  if (cc > 0 && b > 0) return -1;
+  double disc = b*b - cc;
+  if (disc < 0) return -1;
+  return max(0.0, -b - sqrt(disc));
+}
+
+// Distance along the ray to within r of the finite plane, or -1 on a miss
+double rayPlane(const vec3 &from, const vec3 &dir, const Plane *p,
+                double r) {
+  vec3 n = p->norm;
+  n.normalize();
+  double s = (from - p->pos).dotProduct(n); // Signed distance at from
+  double t = 0;
+  if (fabs(s) > r) {
+    double denom = dir.dotProduct(n);
+    if (fabs(denom) < 1e-12) return -1;
+    t = ((s > 0 ? r : -r) - s) / denom;
+    if (t < 0) return -1;
+  }
+  vec3 off = from + dir*t - p->pos;
+  vec3 right = p->right;
+  right.normalize();
+  vec3 up = n.crossProduct(right);
+  if (fabs(off.dotProduct(up)) > p->width/2 ||
+      fabs(off.dotProduct(right)) > p->height/2) return -1;
+  return t;
+}
+
+// Run f(i) for i in [0, n) split into contiguous ranges across threads
+template<class F> void parallelFor(size_t n, int nthreads, F f) {
+  if (nthreads <= 0) nthreads = max(1u, thread::hardware_concurrency());
+  nthreads = min((size_t)nthreads, max((size_t)1, n));
+  vector<thread> threads;
+  for (int t = 0; t < nthreads; ++t) {
+    threads.push_back(thread([=] {
+      for (size_t i = n * t / nthreads; i < n * (t+1) / nthreads; ++i) f(i);
+    }));
+  }
+  for (thread &t : threads) t.join();
+}
+
+} // anonymous namespace
+
+RayHit SceneQuery::raycast(const Ray &ray) const {
+  RayHit best;
+  best.dist = ray.maxDist;
+  vec3 dir = ray.dir;
+  dir.normalize();
+
+  for (Plane *p : world.planes) {
+    double t = rayPlane(ray.from, dir, p, ray.radius);
+    if (t >= 0 && t < best.dist) {
+      best.plane = p;
+      best.dist = t;
+    }
+  }
+
+  // Amanatides-Woo traversal. A sphere hit at t has its center within
+  // R + radius <= PART_D of the ray point at t, so at most one cell away from
+  // the cell containing that point; test the 3x3x3 block around each cell
+  // visited, and stop once the best hit is before the current cell. Only
+  // cells within one of an occupied cell can see a hit, so the walk starts
+  // where the ray enters their bounds and ends where it leaves.
+  const Voxels &vox = world.vox;
+  double o[3] = {ray.from.X - vox.xbase, ray.from.Y - vox.ybase,
+                 ray.from.Z - vox.zbase};
+  double d[3] = {dir.X, dir.Y, dir.Z};
+  int lo[3] = {vox.cellLo.X - 1, vox.cellLo.Y - 1, vox.cellLo.Z - 1};
+  int hi[3] = {vox.cellHi.X + 1, vox.cellHi.Y + 1, vox.cellHi.Z + 1};
+  double tEnter = 0, tExit = best.dist;
+  for (int a = 0; a < 3 && tEnter <= tExit; ++a) {
+    double blo = lo[a] * vox.size, bhi = (hi[a] + 1.0) * vox.size;
+    if (d[a] == 0) {
+      if (o[a] < blo || o[a] > bhi) tEnter = INFINITY;
+      continue;
+    }
+    double t0 = (blo - o[a]) / d[a], t1 = (bhi - o[a]) / d[a];
+    tEnter = max(tEnter, min(t0, t1));
+    tExit = min(tExit, max(t0, t1));
+  }
+  if (vox.cellLo.X > vox.cellHi.X || tEnter > tExit) {
+    if (best.hit()) best.point = ray.from + dir*best.dist;
+    return best;
+  }
+
+  ivec3 c;
+  int *ci[3] = {&c.X, &c.Y, &c.Z};
+  int step[3];
+  double tMax[3], tDelta[3];
+  for (int a = 0; a < 3; ++a) {
+    double cell = floor((o[a] + d[a]*tEnter) / vox.size);
+    *ci[a] = (int)max((double)lo[a], min((double)hi[a], cell));
+    if (d[a] > 0) {
+      step[a] = 1;
+      tMax[a] = ((*ci[a] + 1) * vox.size - o[a]) / d[a];
+      tDelta[a] = vox.size / d[a];
+    }
+    else if (d[a] < 0) {
+      step[a] = -1;
+      tMax[a] = (*ci[a] * vox.size - o[a]) / d[a];
+      tDelta[a] = -vox.size / d[a];
+    }
+    else {
+      step[a] = 0;
+      tMax[a] = tDelta[a] = numeric_limits<double>::infinity();
+    }
+  }
+
+  while (tEnter <= min((double)best.dist, tExit)) {
+    for (int i = -1; i <= 1; ++i) {
+      for (int j = -1; j <= 1; ++j) {
+        for (int k = -1; k <= 1; ++k) {
+          Voxels::Cell *cell = vox.find(ivec3(c.X+i, c.Y+j, c.Z+k));
+          if (!cell) continue;
+          for (CollObj *obj : *cell) {
+            if (obj->getType() != PART) continue;
+            if (((Particle*)obj)->parent == ray.skip) continue;
+            double t = raySphere(ray.from, dir, obj->pos, R + ray.radius);
+            if (t >= 0 && t < best.dist) {
+              best.part = (Particle*)obj;
+              best.plane = nullptr;
+              best.dist = t;
+            }
+          }
+        }
+      }
+    }
+    int a = tMax[0] < tMax[1] ? (tMax[0] < tMax[2] ? 0 : 2)
+                              : (tMax[1] < tMax[2] ? 1 : 2);
+    tEnter = tMax[a];
+    *ci[a] += step[a];
+    tMax[a] += tDelta[a];
+  }
+
+  if (best.hit()) best.point = ray.from + dir*best.dist;
+  else best.dist = ray.maxDist;
+  return best;
+}
+
+void SceneQuery::overlapBox(const vec3 &lo, const vec3 &hi,
+                            vector<Particle*> &out) const {
+  const Voxels &vox = world.vox;
+  vec3 pad(R, R, R);
+  ivec3 clo, chi;
+  if (!vox.clip(lo - pad, hi + pad, clo, chi)) return;
+  vox.forEachIn(clo, chi, [&](const ivec3 &, const Voxels::Cell &cell) {
+    for (CollObj *obj : cell) {
+      if (obj->getType() != PART) continue;
+      // Squared distance from the center to the box
+      const vec3 &p = obj->pos;
+      double dx = max(max((double)(lo.X - p.X), 0.0), (double)(p.X - hi.X));
+      double dy = max(max((double)(lo.Y - p.Y), 0.0), (double)(p.Y - hi.Y));
+      double dz = max(max((double)(lo.Z - p.Z), 0.0), (double)(p.Z - hi.Z));
+      if (dx*dx + dy*dy + dz*dz <= R*R) out.push_back((Particle*)obj);
+    }
+  });
+}
+
+void SceneQuery::overlapSphere(const vec3 &center, double r,
+                               vector<Particle*> &out) const {
+  const Voxels &vox = world.vox;
+  double reach = r + R;
+  vec3 pad(reach, reach, reach);
+  ivec3 clo, chi;
+  if (!vox.clip(center - pad, center + pad, clo, chi)) return;
+  vox.forEachIn(clo, chi, [&](const ivec3 &, const Voxels::Cell &cell) {
+    for (CollObj *obj : cell) {
+      if (obj->getType() != PART) continue;
+      if ((obj->pos - center).getLengthSQ() <= reach*reach) {
+        out.push_back((Particle*)obj);
+      }
+    }
+  });
+}
+
+Particle* SceneQuery::nearest(const vec3 &p, double maxDist) const {
+  const Voxels &vox = world.vox;
+  if (vox.cellLo.X > vox.cellHi.X) return nullptr;
+  // No particle is further than the far corner of the occupied cells
+  double far = 0;
+  double at[3] = {p.X - vox.xbase, p.Y - vox.ybase, p.Z - vox.zbase};
+  int lo[3] = {vox.cellLo.X, vox.cellLo.Y, vox.cellLo.Z};
+  int hi[3] = {vox.cellHi.X + 1, vox.cellHi.Y + 1, vox.cellHi.Z + 1};
+  for (int a = 0; a < 3; ++a) {
+    double d = max(fabs(at[a] - lo[a]*vox.size), fabs(at[a] - hi[a]*vox.size));
+    far += d*d;
+  }
+  maxDist = min(maxDist, sqrt(far));
+
+  Particle *best = nullptr;
+  double bestSq = maxDist*maxDist;
+  // Grow the search box until it contains the best candidate's distance
+  for (double r = vox.size; ; r *= 2) {
+    double reach = min(r, maxDist);
+    vec3 pad(reach, reach, reach);
+    ivec3 clo, chi;
+    if (vox.clip(p - pad, p + pad, clo, chi)) {
+      vox.forEachIn(clo, chi, [&](const ivec3 &, const Voxels::Cell &cell) {
+        for (CollObj *obj : cell) {
+          if (obj->getType() != PART) continue;
+          double dSq = (obj->pos - p).getLengthSQ();
+          if (dSq <= bestSq) {
+            best = (Particle*)obj;
+            bestSq = dSq;
+          }
+        }
+      });
+    }
+    if ((best && bestSq <= reach*reach) || reach >= maxDist) return best;
+  }
+}
+
+void SceneQuery::raycast(const vector<Ray> &rays, vector<RayHit> &out,
+                         int nthreads) const {
+  out.resize(rays.size());
+  parallelFor(rays.size(), nthreads, [&](size_t i) {
+    out[i] = raycast(rays[i]);
+  });
+}
+
+void SceneQuery::nearest(const vector<vec3> &ps, double maxDist,
+                         vector<Particle*> &out, int nthreads) const {
+  out.resize(ps.size());
+  parallelFor(ps.size(), nthreads, [&](size_t i) {
+    out[i] = nearest(ps[i], maxDist);
+  });
+}
+
+void SceneQuery::overlapBox(const vector< pair<vec3,vec3> > &boxes,
+                            vector< vector<Particle*> > &out,
+                            int nthreads) const {
+  out.resize(boxes.size());
+  parallelFor(boxes.size(), nthreads, [&](size_t i) {
+    out[i].clear();
+    overlapBox(boxes[i].first, boxes[i].second, out[i]);
+  });
+}
+
+void SceneQuery::overlapSphere(const vector<vec3> &centers, double r,
+                               vector< vector<Particle*> > &out,
+                               int nthreads) const {
+  out.resize(centers.size());
+  parallelFor(centers.size(), nthreads, [&](size_t i) {
+    out[i].clear();
+    overlapSphere(centers[i], r, out[i]);
+  });
+}
@@ -0,0 +1,60 @@
+#ifndef QUERY_H
+#define QUERY_H
+
+#include "world.h"
+
+struct Ray {
+  vec3 from;
+  vec3 dir;
+  double maxDist = 1e6; // May be infinite
+  double radius = 0; // Sweep a sphere instead, at most PART_D/2
+  const Obj *skip = nullptr; // Pass through this body's particles
+};
+
+struct RayHit {
+  Particle *part = nullptr; // At most one of part and plane is set
+  Plane *plane = nullptr;
+  double dist = 0.0;
+  vec3 point;
+
+  bool hit() const { return part || plane; }
+};
+
+// Read-only queries against a world, reusing its voxel grid as the
+// acceleration structure, and searching only within the bounds of its
+// occupied cells. Particles are spheres of diameter PART_D, and results
+// reflect the particle positions of the last World::bin(). A step's own
+// binning leaves out large bodies that touch nothing, so bin() again first.
+// Queries may run concurrently with each other, but not with a step.
+struct SceneQuery {
+  const World &world;
+
+  SceneQuery(const World &world) : world(world) {}
+
+  // Closest particle or plane along the ray, walking the grid with a 3D-DDA.
+  // A swept sphere hits at the first touch.
+  RayHit raycast(const Ray &ray) const;
+
+  // Particles whose sphere overlaps the box or sphere
+  void overlapBox(const vec3 &lo, const vec3 &hi,
+                  vector<Particle*> &out) const;
+  void overlapSphere(const vec3 &center, double r,
+                     vector<Particle*> &out) const;
+
+  // Particle with center closest to p, or null if none within maxDist,
+  // which may be infinite
+  Particle* nearest(const vec3 &p, double maxDist) const;
+
+  // Batched versions, split across nthreads (<= 0 uses all cores)
+  void raycast(const vector<Ray> &rays, vector<RayHit> &out,
+               int nthreads = 0) const;
+  void nearest(const vector<vec3> &ps, double maxDist,
+               vector<Particle*> &out, int nthreads = 0) const;
+  void overlapBox(const vector< pair<vec3,vec3> > &boxes,
+                  vector< vector<Particle*> > &out, int nthreads = 0) const;
+  void overlapSphere(const vector<vec3> &centers, double r,
+                     vector< vector<Particle*> > &out,
+                     int nthreads = 0) const;
+};
+
+#endif
@@ -0,0 +1,38 @@
+#include <thread>
+
+#include "realtime.h"
+
+void RealtimeLoop::run() {
+  double last = elapsed();
+  double acc = 0; // Wall time not yet simulated
+  int64_t steps = 0;
+  world.snapshot(cur);
+
+  while (!quit.load(memory_order_relaxed)) {
+    double dt = world.ts / speed;
+    double now = elapsed();
+    acc += now - last;
+    last = now;
+    // Fall behind rather than spiral when a step costs more than dt
+    if (acc > maxSteps*dt) acc = maxSteps*dt;
+
+    if (acc < dt) {
+      this_thread::sleep_for(chrono::duration<double>(dt - acc));
+      continue;
+    }
+    while (acc >= dt) {
+      prev.swap(cur);
+      world.step();
+      world.snapshot(cur);
+      acc -= dt;
+      ++steps;
+    }
+
+    Frame &f = frames.writeSlot();
+    f.prev = prev;
+    f.cur = cur;
+    f.time = now - acc;
+    f.step = steps;
+    frames.publish();
+  }
+}
@@ -0,0 +1,86 @@
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#include "world.h"
+
+// Single producer, single consumer handoff of the latest value. The writer
+// fills its back slot and swaps it with the middle one; the reader swaps the
+// middle slot for its front one only if something new arrived. Neither side
+// ever waits, and the reader always sees a whole value.
+template <class T>
+struct TripleBuffer {
+  TripleBuffer() : back(0), middle(1), front(2) {}
+  TripleBuffer(const TripleBuffer&) = delete;
+  TripleBuffer& operator=(const TripleBuffer&) = delete;
+
+  // Writer side: fill this, then publish
+  T& writeSlot() { return slots[back]; }
+
+  void publish() {
+    back = middle.exchange(back | FRESH, memory_order_acq_rel) & INDEX;
+  }
+
+  // Reader side: newest published value, or the previous one if nothing new
+  const T& read() {
+    if (middle.load(memory_order_relaxed) & FRESH) {
+      front = middle.exchange(front, memory_order_acq_rel) & INDEX;
+    }
+    return slots[front];
+  }
+
+private:
+  enum { INDEX = 3, FRESH = 4 };
+
+  T slots[3];
+  uint8_t back; // Writer only
+  atomic<uint8_t> middle; // Index of the handoff slot, plus FRESH
+  uint8_t front; // Reader only
+};
+
+// The two most recent states, cur is due at wall time time (seconds since the
+// loop started) and prev one timestep earlier
+struct Frame {
+  vector<BodyState> prev;
+  vector<BodyState> cur;
+  double time = -1; // < 0 until the first step
+  int64_t step = 0;
+};
+
+// Steps a world at a fixed rate on the calling thread and publishes every
+// new state, so a renderer on another thread can draw at its own rate.
+struct RealtimeLoop {
+  World &world;
+  TripleBuffer<Frame> frames;
+  atomic<bool> quit;
+
+  double speed = 1.0; // Simulated seconds per wall second
+  int maxSteps = 5; // Per tick; wall time beyond this is dropped
+
+  RealtimeLoop(World &world) : world(world), quit(false),
+                               start(chrono::steady_clock::now()) {}
+
+  // Step until quit is set
+  void run();
+
+  // Wall seconds since the loop was made, on the clock Frame::time uses
+  double elapsed() const {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  }
+
+  // How far from prev to cur the renderer should be at wall time now. Drawing
+  // one timestep behind means there is always a later state to blend toward.
+  real blend(const Frame &f, double now) const {
+    double a = (now - f.time) * speed / world.ts;
+    return a < 0 ? 0 : a > 1 ? 1 : a;
+  }
+
+private:
+  chrono::steady_clock::time_point start;
+  vector<BodyState> prev, cur;
+};
+
+#endif
@@ -0,0 +1,562 @@
+#include <chrono>
+#include <cmath>
+#include <algorithm>
+#include <random>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <iostream>
+
+#include "regress.h"
+#include "query.h"
+
+// The contact model, per colliding pair (see Collision::applyForces), adds
+// a spring k*(PART_D - distance) pushing the two apart, plus eta times each
+// particle's own velocity. Bodies have unit mass and inertia, and the
+// scenarios below step with short timesteps so the integrator stays close to
+// the continuous answer.
+//
+// Two references follow the model as it stands rather than textbook
+// physics, and say so in their check names:
+// - The eta term adds eta*v instead of subtracting it, so it only damps for
+//   eta < 0, which is what these scenarios use.
+// - Particles alone in neighbouring cells each find the other, so their pair
+//   force applies twice, where particles sharing a cell count once.
+// Fixing either changes these references along with every trajectory.
+
+namespace {
+
+Obj *particleBody(const vec3 &pos, const vec3 &v) {
+  Obj *o = new Obj();
+  o->addPart(vec3(0,0,0));
+  o->pos = pos;
+  o->v = v;
+  return o;
+}
+
+// Steps w with be, adding the time taken to r
+void timedStep(World &w, const Backend &be, RegressResult &r) {
+  auto t0 = chrono::steady_clock::now();
+  be.step(w);
+  r.seconds += chrono::duration<double>(chrono::steady_clock::now() -
+                                        t0).count();
+  ++r.steps;
+}
+
+double relErr(double got, double want) {
+  return fabs(got - want) / fabs(want);
+}
+
+// A particle flies at speed u into a plane. It moves in a straight line until
+// within PART_D, then the spring and damping act as a damped oscillator,
+// overlap'' = -k overlap + eta overlap', for half a period. It leaves after
+// T = pi / sqrt(k - eta^2/4) at u*exp(eta*T/2).
+RegressResult planeBounce(const Backend &be) {
+  RegressResult r;
+  r.name = "plane bounce";
+  World w;
+  w.ts = 0.001;
+  w.params.k = 10;
+  w.params.eta = -0.2;
+  w.params.kt = 0.1;
+  Plane *pl = new Plane();
+  pl->norm = vec3(0,1,0);
+  pl->right = vec3(1,0,0);
+  pl->width = pl->height = 4;
+  w.planes.push_back(pl);
+  const double u = 1, y0 = 1;
+  Obj *o = particleBody(vec3(0,y0,0), vec3(0,-u,0));
+  w.objects.push_back(o);
+
+  // Free flight, stopping short of the plane
+  int flight = (int)((y0 - PART_D) / u / w.ts) - 10;
+  for (int i = 0; i < flight; ++i) timedStep(w, be, r);
+  double want = y0 - u*flight*w.ts;
+  r.checks.push_back({"free flight position", fabs(o->pos.Y - want), 1e-4});
+
+  // Through the contact and out again
+  int entry = -1, exit = -1;
+  for (int i = flight; i < flight + 10000 && exit < 0; ++i) {
+    timedStep(w, be, r);
+    if (entry < 0 && o->pos.Y < PART_D) entry = i;
+    if (entry >= 0 && o->pos.Y >= PART_D) exit = i;
+  }
+  double k = w.params.k, eta = w.params.eta;
+  double T = M_PI / sqrt(k - eta*eta/4);
+  double dur = exit < 0 ? INFINITY : (exit - entry)*w.ts;
+  r.checks.push_back({"contact time", fabs(dur - T), 3*w.ts});
+  r.checks.push_back({"rebound speed / expected (eta < 0 damps, as the "
+                      "baseline does)", relErr(o->v.Y, u*exp(eta*T/2)), 0.01});
+  r.checks.push_back({"sideways speed", o->v.getLength() - fabs(o->v.Y),
+                      1e-6});
+  return r;
+}
+
+// Two single particle bodies meet head on at speed u each. They stay either
+// side of a cell boundary, so with the baseline's double counting the pair's
+// forces apply twice: overlap'' = -4k overlap + 2 eta overlap'. They part
+// after T = pi / sqrt(4k - eta^2) with their kinetic energy scaled by
+// exp(2 eta T), and total momentum stays zero.
+RegressResult headOn(const Backend &be) {
+  RegressResult r;
+  r.name = "head-on collision";
+  World w;
+  w.ts = 0.001;
+  w.params.k = 10;
+  w.params.eta = -0.2;
+  const double u = 0.5;
+  Obj *a = particleBody(vec3(-0.5,0.1,0.1), vec3(u,0,0));
+  Obj *b = particleBody(vec3(0.5,0.1,0.1), vec3(-u,0,0));
+  w.objects = {a, b};
+
+  auto energy = [&]() {
+    return 0.5*(a->v.getLengthSQ() + b->v.getLengthSQ());
+  };
+  double e0 = energy();
+  bool touched = false;
+  for (int i = 0; i < 10000; ++i) {
+    timedStep(w, be, r);
+    real dist = (b->pos - a->pos).getLength();
+    if (dist < PART_D) touched = true;
+    else if (touched) break;
+  }
+  double k = w.params.k, eta = w.params.eta;
+  double T = M_PI / sqrt(4*k - eta*eta);
+  r.checks.push_back({"energy kept / expected (eta < 0 damps, pair force "
+                      "counted twice across cells, as the baseline does)",
+                      relErr(energy() / e0, exp(2*eta*T)), 0.01});
+  r.checks.push_back({"momentum", (a->v + b->v).getLength(), 1e-6});
+  r.checks.push_back({"separating", touched && a->v.X < 0 && b->v.X > 0 ?
+                      0.0 : 1.0, 0});
+  return r;
+}
+
+// A particle at 40 u/s travels 1.2 per 0.03 s step, more than twice PART_D,
+// toward a plane and, in another world, toward a wall of fixed particles.
+// With k = 20000 a bounce lasts pi / sqrt(k) = 0.02 s, under one step.
+// Without CCD the particle lands past the obstacle or deep in it and is
+// pushed on through; with CCD it stops at the time of impact, substeps the
+// contact and comes back out.
+RegressResult tunnelling(const Backend &be) {
+  RegressResult r;
+  r.name = "CCD tunnelling";
+  const double u = 40;
+  for (bool wall : {false, true}) {
+    for (bool ccd : {false, true}) {
+      World w;
+      w.ts = 0.03;
+      w.params.k = 20000;
+      w.params.eta = 0;
+      w.ccd = ccd;
+      if (wall) {
+        Obj *o = new Obj();
+        for (int y = -4; y <= 4; ++y) {
+          for (int z = -4; z <= 4; ++z) {
+            o->addPart(vec3(0, y*PART_D, z*PART_D));
+          }
+        }
+        o->fixed = true;
+        w.objects.push_back(o);
+      }
+      else {
+        Plane *pl = new Plane();
+        pl->norm = vec3(-1,0,0);
+        pl->right = vec3(0,1,0);
+        pl->width = pl->height = 4;
+        w.planes.push_back(pl);
+      }
+      Obj *o = particleBody(vec3(-1.1,0.1,0.1), vec3(u,0,0));
+      w.objects.push_back(o);
+      for (int i = 0; i < 10; ++i) timedStep(w, be, r);
+
+      string what = wall ? "wall" : "plane";
+      if (ccd) {
+        r.checks.push_back({what + " not bounced off with CCD",
+                            o->pos.X < 0 && o->v.X < 0 ? 0.0 : 1.0, 0});
+      }
+      else {
+        r.checks.push_back({what + " not passed through without CCD",
+                            o->pos.X > 0 && o->v.X > 0 ? 0.0 : 1.0, 0});
+      }
+    }
+  }
+  return r;
+}
+
+// A rod spins freely at w about its center. After time t each part at
+// offset x along the rod is at x*(cos |w|t, sin |w|t), moving at |w|*|x| at
+// right angles to it.
+RegressResult spin(const Backend &be) {
+  RegressResult r;
+  r.name = "spinning body";
+  World w;
+  w.ts = 0.01;
+  Obj *o = new Obj();
+  for (int i = -2; i <= 2; ++i) o->addPart(vec3(i*PART_D, 0, 0));
+  const double rate = 2;
+  o->w = vec3(0, 0, rate);
+  w.objects.push_back(o);
+
+  const int steps = 300;
+  for (int i = 0; i < steps; ++i) timedStep(w, be, r);
+  o->push();
+  double angle = rate * steps * w.ts;
+  double posErr = 0, velErr = 0;
+  for (int i = 0; i < o->parts.size(); ++i) {
+    double x = o->loc(i).X;
+    vec3 want(x*cos(angle), x*sin(angle), 0);
+    posErr = max(posErr, (double)(o->parts[i]->pos - want).getLength());
+    vec3 tangent(-x*sin(angle)*rate, x*cos(angle)*rate, 0);
+    velErr = max(velErr, (double)(o->parts[i]->vel() - tangent).getLength());
+  }
+  r.checks.push_back({"part position", posErr, 1e-4});
+  r.checks.push_back({"tangential velocity", velErr, 1e-4});
+  r.checks.push_back({"center drift", o->pos.getLength(), 0});
+  return r;
+}
+
+// Cubes stacked on a plane under gravity g, starting just touching. Once
+// settled, each layer of side*side contacts carries the weight of the cubes
+// above it, so the bottom layer sinks into the plane by n g / (side^2 k) and
+// the layer under cube i by (n-i) g / (2 side^2 k), the pair force being
+// counted twice across cells as the baseline does. The contacts are soft
+// springs, so the stack is kept short enough that their resistance to
+// tilting beats gravity's.
+RegressResult restingStack(const Backend &be) {
+  RegressResult r;
+  r.name = "resting stack";
+  World w;
+  w.ts = 0.01;
+  w.params.eta = -0.5; // Damps, see above
+  w.gravity = vec3(0, -1, 0);
+  Plane *pl = new Plane();
+  pl->norm = vec3(0,1,0);
+  pl->right = vec3(1,0,0);
+  pl->width = pl->height = 8;
+  w.planes.push_back(pl);
+  const int n = 4, side = 4;
+  const double height = side*PART_D; // Center to center when touching
+  for (int i = 0; i < n; ++i) {
+    Obj *o = new Obj();
+    for (int x = 0; x < side; ++x) {
+      for (int y = 0; y < side; ++y) {
+        for (int z = 0; z < side; ++z) {
+          o->addPart(vec3(x - (side-1)/2.0, y - (side-1)/2.0,
+                          z - (side-1)/2.0) * PART_D);
+        }
+      }
+    }
+    o->pos = vec3(0.1, height/2 + PART_D/2 + i*height, 0.1);
+    w.objects.push_back(o);
+  }
+
+  for (int i = 0; i < 3000; ++i) timedStep(w, be, r);
+  double g = -w.gravity.Y, k = w.params.k;
+  double speed = 0, slide = 0, sinkErr = 0;
+  for (int i = 0; i < n; ++i) {
+    Obj *o = w.objects[i];
+    speed = max(speed, (double)(o->v.getLength() + o->w.getLength()));
+    slide = max(slide, hypot(o->pos.X - 0.1, o->pos.Z - 0.1));
+    // How much closer than just touching to the plane or the cube below
+    double depth = i ? height - (o->pos.Y - w.objects[i-1]->pos.Y) :
+        height/2 + PART_D/2 - o->pos.Y;
+    double want = (n - i)*g / (side*side*k) / (i ? 2 : 1);
+    sinkErr = max(sinkErr, relErr(depth, want));
+  }
+  r.checks.push_back({"settled speed", speed, 1e-3});
+  r.checks.push_back({"sideways slide", slide, 1e-4});
+  r.checks.push_back({"sink under load / expected (pair force counted twice "
+                      "across cells, as the baseline does)", sinkErr, 0.01});
+  return r;
+}
+
+// A pile of 200 small cubes, packed closer than touching so every contact
+// pushes from the first step, stepped with be and decomposed into 2, 4 and 7
+// slabs. Ranks sum contact forces in another order, so after 10 steps they
+// may only differ from be by float rounding.
+void pile(World &w) {
+  w.ccd = false; // So it can be decomposed
+  w.gravity = vec3(0, -1, 0);
+  Plane *pl = new Plane();
+  pl->norm = vec3(0,1,0);
+  pl->right = vec3(1,0,0);
+  pl->width = pl->height = 40;
+  w.planes.push_back(pl);
+  mt19937 rng(7);
+  uniform_real_distribution<double> jitter(-0.05, 0.05);
+  for (int i = 0; i < 200; ++i) {
+    Obj *o = new Obj();
+    for (int c = 0; c < 8; ++c) {
+      o->addPart(vec3(c & 1, (c >> 1) & 1, c >> 2) * PART_D -
+                 vec3(1,1,1) * (PART_D/2));
+    }
+    o->pos = vec3((i % 20)*0.9 + jitter(rng), 0.5 + (i / 40)*0.9,
+                  ((i / 20) % 2)*0.9 + jitter(rng));
+    o->v = vec3(jitter(rng), jitter(rng), jitter(rng));
+    w.objects.push_back(o);
+  }
+}
+
+RegressResult decomposedPile(const Backend &be) {
+  RegressResult r;
+  r.name = "decomposed pile";
+  const int steps = 10;
+  World ref;
+  pile(ref);
+  for (int i = 0; i < steps; ++i) timedStep(ref, be, r);
+
+  for (int ranks : {2, 4, 7}) {
+    World w;
+    pile(w);
+    Backend split;
+    split.ranks = ranks;
+    split.lo = 0;
+    split.width = 18.0 / ranks;
+    for (int i = 0; i < steps; ++i) split.step(w);
+    double err = 0;
+    for (int i = 0; i < w.objects.size(); ++i) {
+      const Obj *a = ref.objects[i], *b = w.objects[i];
+      err = max(err, (double)(a->pos - b->pos).getLength());
+      err = max(err, (double)(a->v - b->v).getLength());
+    }
+    r.checks.push_back({to_string(ranks) + " ranks, largest pos or vel "
+                        "difference", err, 1e-4});
+  }
+
+  // A body handed to the next rank must stay the same object, in place
+  World w;
+  w.ccd = false;
+  Obj *o = new Obj();
+  o->addPart(vec3(0,0,0));
+  o->v = vec3(10,0,0);
+  w.objects.push_back(o);
+  Backend split;
+  split.ranks = 2;
+  split.lo = 0;
+  split.width = 1;
+  for (int i = 0; i < steps; ++i) split.step(w);
+  r.checks.push_back({"bodies moved in memory crossing ranks",
+                      (double)(w.objects[0] != o), 0});
+  r.checks.push_back({"crossing body pos error",
+                      fabs(o->pos.X - 10*w.ts*steps), 1e-4});
+  return r;
+}
+
+// The pile stepped on 1 and 4 threads, which must agree bit for bit, and
+// worlds with no bodies, which must step on 4 threads at all. Those step on
+// a thread of their own, so a hang fails the check instead of the run; a
+// hung thread is left behind with its worlds.
+RegressResult threadedPile() {
+  RegressResult r;
+  r.name = "threaded pile";
+  World serial, threaded;
+  pile(serial);
+  pile(threaded);
+  Backend one, four;
+  four.threads = 4;
+  int differ = 0;
+  for (int i = 0; i < 10; ++i) {
+    timedStep(serial, one, r);
+    four.step(threaded);
+    vector<BodyState> a, b;
+    serial.snapshot(a);
+    threaded.snapshot(b);
+    for (int j = 0; j < a.size(); ++j) {
+      differ += hashBody(a[j]) != hashBody(b[j]);
+    }
+  }
+  r.checks.push_back({"bodies differing from serial, over 10 steps",
+                      (double)differ, 0});
+
+  struct Bodiless {
+    World empty, planesOnly;
+    atomic<bool> done{false};
+  };
+  shared_ptr<Bodiless> worlds = make_shared<Bodiless>();
+  pile(worlds->planesOnly);
+  for (Obj *o : worlds->planesOnly.objects) delete o;
+  worlds->planesOnly.objects.clear();
+  thread([worlds, four] {
+    four.step(worlds->empty);
+    four.step(worlds->planesOnly);
+    worlds->done = true;
+  }).detach();
+  for (int i = 0; i < 1000 && !worlds->done; ++i) {
+    this_thread::sleep_for(chrono::milliseconds(10));
+  }
+  r.checks.push_back({"worlds without bodies not stepped on 4 threads "
+                      "within 10 s", (double)!worlds->done, 0});
+  return r;
+}
+
+// Distance along the unit ray to within r of c, or -1 on a miss
+double rayToSphere(const vec3 &from, const vec3 &dir, const vec3 &c,
+                   double r) {
+  vec3 oc = from - c;
+  double b = oc.dotProduct(dir);
+  double cc = oc.getLengthSQ() - r*r;
+  if (cc > 0 && b > 0) return -1;
+  double disc = b*b - cc;
+  if (disc < 0) return -1;
+  return max(0.0, -b - sqrt(disc));
+}
+
+// Scene queries checked against a scan of every particle, 2000 of each kind
+// on scattered bodies, some from far outside the grid or unbounded. Then
+// the same unbounded queries on an empty world, which must simply miss.
+RegressResult queries(const Backend &be) {
+  RegressResult r;
+  r.name = "scene queries";
+  World w;
+  mt19937 rng(11);
+  uniform_real_distribution<double> u(-1, 1);
+  auto rnd = [&](double s) { return vec3(u(rng), u(rng), u(rng)) * s; };
+  for (int i = 0; i < 80; ++i) {
+    Obj *o = new Obj();
+    int n = 1 + rng() % 6;
+    for (int j = 0; j < n; ++j) {
+      o->addPart(vec3(rng() % 3, rng() % 3, rng() % 3) * PART_D);
+    }
+    o->pos = rnd(5);
+    w.objects.push_back(o);
+  }
+  timedStep(w, be, r);
+  w.bin();
+  vector<Particle*> parts;
+  for (Obj *o : w.objects) {
+    parts.insert(parts.end(), o->parts.begin(), o->parts.end());
+  }
+  SceneQuery q(w);
+  const int n = 2000;
+  const double R = PART_D/2;
+
+  vector<Ray> rays(n);
+  for (int i = 0; i < n; ++i) {
+    Ray &ray = rays[i];
+    ray.dir = rnd(1);
+    ray.from = i % 10 == 0 ? ray.dir * -1e7 + rnd(3) : rnd(8);
+    ray.radius = (i % 3) * R / 2;
+    if (i % 4 == 1) ray.maxDist = INFINITY;
+    if (i % 4 == 2) ray.maxDist = 1 + 9*fabs(u(rng));
+  }
+  vector<RayHit> hits;
+  q.raycast(rays, hits, 2);
+  int rayMiss = 0;
+  for (int i = 0; i < n; ++i) {
+    vec3 dir = rays[i].dir;
+    dir.normalize();
+    Particle *want = nullptr;
+    double best = rays[i].maxDist;
+    for (Particle *p : parts) {
+      double t = rayToSphere(rays[i].from, dir, p->pos, R + rays[i].radius);
+      if (t >= 0 && t < best) {
+        want = p;
+        best = t;
+      }
+    }
+    // Parts may coincide, so compare distances rather than which part
+    rayMiss += !hits[i].part != !want || (want && hits[i].dist != best);
+  }
+  r.checks.push_back({"raycast mismatches", (double)rayMiss, 0});
+
+  vector<vec3> points(n);
+  for (int i = 0; i < n; ++i) points[i] = i % 10 == 0 ? rnd(1e8) : rnd(8);
+  int nearMiss = 0;
+  for (double maxDist : {(double)INFINITY, 2.0}) {
+    vector<Particle*> found;
+    q.nearest(points, maxDist, found, 2);
+    for (int i = 0; i < n; ++i) {
+      Particle *want = nullptr;
+      double bestSq = maxDist*maxDist;
+      for (Particle *p : parts) {
+        double dSq = (p->pos - points[i]).getLengthSQ();
+        if (dSq < bestSq) {
+          want = p;
+          bestSq = dSq;
+        }
+      }
+      nearMiss += !found[i] != !want || (want &&
+          (found[i]->pos - points[i]).getLengthSQ() != bestSq);
+    }
+  }
+  r.checks.push_back({"nearest mismatches", (double)nearMiss, 0});
+
+  // Overlaps, as sets
+  auto same = [](vector<Particle*> a, vector<Particle*> b) {
+    sort(a.begin(), a.end());
+    sort(b.begin(), b.end());
+    return a == b;
+  };
+  vector< pair<vec3,vec3> > boxes(n);
+  for (int i = 0; i < n; ++i) {
+    vec3 c = rnd(6), e = vec3(fabs(u(rng)), fabs(u(rng)), fabs(u(rng)));
+    boxes[i] = make_pair(c - e, c + e);
+  }
+  vector< vector<Particle*> > inBox, inSphere;
+  q.overlapBox(boxes, inBox, 2);
+  const double sr = 1;
+  q.overlapSphere(points, sr, inSphere, 2);
+  int boxMiss = 0, sphereMiss = 0;
+  for (int i = 0; i < n; ++i) {
+    const vec3 &lo = boxes[i].first, &hi = boxes[i].second;
+    vector<Particle*> box, sphere;
+    for (Particle *p : parts) {
+      double dx = max(max((double)(lo.X - p->pos.X), 0.0),
+                      (double)(p->pos.X - hi.X));
+      double dy = max(max((double)(lo.Y - p->pos.Y), 0.0),
+                      (double)(p->pos.Y - hi.Y));
+      double dz = max(max((double)(lo.Z - p->pos.Z), 0.0),
+                      (double)(p->pos.Z - hi.Z));
+      if (dx*dx + dy*dy + dz*dz <= R*R) box.push_back(p);
+      if ((p->pos - points[i]).getLengthSQ() <= (sr + R)*(sr + R)) {
+        sphere.push_back(p);
+      }
+    }
+    boxMiss += !same(box, inBox[i]);
+    sphereMiss += !same(sphere, inSphere[i]);
+  }
+  r.checks.push_back({"box overlap mismatches", (double)boxMiss, 0});
+  r.checks.push_back({"sphere overlap mismatches", (double)sphereMiss, 0});
+
+  World empty;
+  empty.bin();
+  SceneQuery eq(empty);
+  Ray ray;
+  ray.dir = vec3(1,0,0);
+  ray.maxDist = INFINITY;
+  bool quiet = !eq.raycast(ray).hit() && !eq.nearest(vec3(0,0,0), INFINITY);
+  r.checks.push_back({"unbounded queries on an empty world hit something",
+                      quiet ? 0.0 : 1.0, 0});
+  return r;
+}
+
+} // anonymous namespace
+
+vector<RegressResult> runRegressions(const Backend &be) {
+  return {planeBounce(be), headOn(be), tunnelling(be), spin(be),
+          restingStack(be), decomposedPile(be), threadedPile(), queries(be)};
+}
+
+int reportRegressions(int threads) {
+  vector<Backend> backends(1);
+  if (threads > 1) {
+    backends.push_back(Backend());
+    backends.back().threads = threads;
+  }
+  int failed = 0;
+  for (const Backend &be : backends) {
+    cout << "threads " << be.threads << endl;
+    for (const RegressResult &r : runRegressions(be)) {
+      cout << "  " << (r.pass() ? "ok  " : "FAIL") << " " << r.name << ", "
+           << r.steps << " steps, " << r.seconds*1e6 / max(r.steps, 1)
+           << " us/step" << endl;
+      for (const RegressCheck &c : r.checks) {
+        cout << "    " << (c.pass() ? "ok  " : "FAIL") << " " << c.what
+             << ": " << c.error << " (tolerance " << c.tol << ")" << endl;
+      }
+      failed += !r.pass();
+    }
+  }
+  if (failed) cout << failed << " scenarios failed" << endl;
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,46 @@
+#ifndef REGRESS_H
+#define REGRESS_H
+
+#include <string>
+
+#include "replay.h"
+
+// One comparison against a closed form answer
+struct RegressCheck {
+  string what;
+  double error; // Deviation from the answer, in the units of what
+  double tol;
+
+  bool pass() const { return error <= tol; }
+};
+
+// One reference scenario, with the time spent stepping it
+struct RegressResult {
+  string name;
+  int steps = 0;
+  double seconds = 0;
+  vector<RegressCheck> checks;
+
+  bool pass() const {
+    for (const RegressCheck &c : checks) {
+      if (!c.pass()) return false;
+    }
+    return true;
+  }
+};
+
+// Step each analytic reference scenario with be and check it against its
+// closed form: free flight into a plane and the bounce off it, a head-on
+// collision of two particles, a spinning body and a resting stack. Then
+// check that a fast particle tunnels through a plane and a wall of fixed
+// particles without CCD and bounces off them with it, that a pile stepped in
+// slabs on several ranks stays with be, that threaded steps match serial
+// ones exactly, and that scene queries after a step with be agree with a
+// brute force scan.
+vector<RegressResult> runRegressions(const Backend &be);
+
+// Run and print runRegressions serially and, if threads > 1, again on that
+// many threads. Returns 1 if any check failed, else 0.
+int reportRegressions(int threads);
+
+#endif
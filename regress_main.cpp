@@ -0,0 +1,10 @@
+#include <cstdlib>
+
+#include "regress.h"
+
+// RigidVoxelsTest [threads]: the reference scenarios of RigidVoxels regress,
+// linked against the core alone so builds without irrlicht can run them.
+// Returns 1 if any check fails.
+int main(int argc, char** argv) {
+  return reportRegressions(argc > 1 ? atoi(argv[1]) : 1);
+}
@@ -0,0 +1,137 @@
+#include <fstream>
+#include <cstring>
+
+#include "replay.h"
+
+namespace {
+
+const uint64_t FNV_OFFSET = 14695981039346656037ull;
+const uint64_t FNV_PRIME = 1099511628211ull;
+const char MAGIC[4] = {'R', 'V', 'H', '1'};
+
+uint64_t fnv(uint64_t h, const void *data, size_t n) {
+  const unsigned char *b = (const unsigned char *) data;
+  for (size_t i = 0; i < n; ++i) {
+    h ^= b[i];
+    h *= FNV_PRIME;
+  }
+  return h;
+}
+
+uint64_t fnv(uint64_t h, const vec3 &v) {
+  h = fnv(h, &v.X, sizeof(real));
+  h = fnv(h, &v.Y, sizeof(real));
+  return fnv(h, &v.Z, sizeof(real));
+}
+
+} // anonymous namespace
+
+uint64_t hashBody(const BodyState &b) {
+  uint64_t h = fnv(FNV_OFFSET, b.pos);
+  h = fnv(h, b.v);
+  h = fnv(h, &b.theta.X, sizeof(real));
+  h = fnv(h, &b.theta.Y, sizeof(real));
+  h = fnv(h, &b.theta.Z, sizeof(real));
+  h = fnv(h, &b.theta.W, sizeof(real));
+  return fnv(h, b.w);
+}
+
+uint64_t hashBody(const Obj &o) {
+  return hashBody(BodyState{o.pos, o.v, o.theta, o.w});
+}
+
+void StepHash::compute(const vector<BodyState> &state) {
+  bodies.resize(state.size());
+  world = FNV_OFFSET;
+  for (int i = 0; i < bodies.size(); ++i) {
+    bodies[i] = hashBody(state[i]);
+    world = fnv(world, &bodies[i], sizeof(uint64_t));
+  }
+}
+
+void Backend::step(World &w) const {
+  w.ranks = ranks;
+  w.slabLo = lo;
+  w.slabWidth = width;
+  w.threads = threads;
+  w.step();
+}
+
+// File is MAGIC, the body count, then per step the world hash followed by
+// each body's hash
+int recordHashes(World &world, int steps, const Backend &be,
+                 const char *path) {
+  ofstream out(path, ios::binary);
+  if (!out) {
+    cerr << "Could not write " << path << endl;
+    return 1;
+  }
+  uint32_t n = world.objects.size();
+  out.write(MAGIC, sizeof(MAGIC));
+  out.write((const char *) &n, sizeof(n));
+
+  {
+    StepHash sh;
+    AsyncSink< vector<BodyState> > sink([&](const vector<BodyState> &st) {
+      sh.compute(st);
+      out.write((const char *) &sh.world, sizeof(uint64_t));
+      out.write((const char *) sh.bodies.data(), n*sizeof(uint64_t));
+    });
+    for (int s = 0; s < steps; ++s) {
+      be.step(world);
+      world.snapshot(sink.next());
+      sink.submit();
+    }
+  }
+  if (!out) {
+    cerr << "Write to " << path << " failed" << endl;
+    return 1;
+  }
+  return 0;
+}
+
+int verifyHashes(World &world, int steps, const Backend &be,
+                 const char *path) {
+  ifstream in(path, ios::binary);
+  char magic[4];
+  uint32_t n = 0;
+  in.read(magic, sizeof(magic));
+  in.read((char *) &n, sizeof(n));
+  if (!in || memcmp(magic, MAGIC, sizeof(MAGIC)) != 0) {
+    cerr << path << " is not a hash recording" << endl;
+    return 1;
+  }
+  if (n != world.objects.size()) {
+    cerr << path << " has " << n << " bodies, the world has "
+         << world.objects.size() << endl;
+    return 1;
+  }
+
+  StepHash sh;
+  vector<BodyState> state;
+  uint64_t recWorld;
+  vector<uint64_t> recBodies(n);
+  for (int s = 0; s < steps; ++s) {
+    in.read((char *) &recWorld, sizeof(uint64_t));
+    in.read((char *) recBodies.data(), n*sizeof(uint64_t));
+    if (!in) {
+      cerr << path << " ends after " << s << " steps" << endl;
+      return 1;
+    }
+    be.step(world);
+    world.snapshot(state);
+    sh.compute(state);
+    if (sh.world == recWorld) continue;
+
+    for (int i = 0; i < n; ++i) {
+      if (sh.bodies[i] == recBodies[i]) continue;
+      const Obj *o = world.objects[i];
+      cout << "Diverged at step " << s + 1 << ", body " << i << ": pos "
+           << o->pos << " v " << o->v << " theta " << o->theta << " w "
+           << o->w << endl;
+      return 2;
+    }
+  }
+  cout << "All " << steps << " steps match" << endl;
+  return 0;
+}
@@ -0,0 +1,40 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <cstdint>
+
+#include "world.h"
+
+// FNV-1a over the exact bits of a body's pos, v, theta and w
+uint64_t hashBody(const BodyState &b);
+uint64_t hashBody(const Obj &o);
+
+// Hashes of one step: every body, and all of them combined in order
+struct StepHash {
+  uint64_t world;
+  vector<uint64_t> bodies;
+
+  void compute(const vector<BodyState> &state);
+};
+
+// How each step is taken. ranks > 1 steps the world decomposed, splitting
+// [lo, lo + ranks*width) along X. Otherwise World::step runs on threads.
+struct Backend {
+  int ranks = 1;
+  int threads = 1;
+  double lo = 0;
+  double width = 0;
+
+  void step(World &w) const;
+};
+
+// Step world and write the hash of every step to path, hashing and writing
+// each step while the next one computes. Returns 0 on success.
+int recordHashes(World &world, int steps, const Backend &be, const char *path);
+
+// Step world and compare each step with a recording, reporting the first step
+// and body that differ. Returns 0 if every step matches, 2 on divergence and
+// 1 if the recording could not be used.
+int verifyHashes(World &world, int steps, const Backend &be, const char *path);
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef RIGIDVOXELS_H
+#define RIGIDVOXELS_H
+
+// Everything an embedding application needs from the physics core. Link
+// against librigidvoxels; no renderer is required.
+#include "types.h"
+#include "world.h"
+#include "scenario.h"
+#include "batch.h"
+#include "domain.h"
+#include "query.h"
+#include "realtime.h"
+#include "replay.h"
+#include "taskgraph.h"
+#include "constraint.h"
+
+#endif
@@ -0,0 +1,136 @@
+#ifndef RVMATH_H
+#define RVMATH_H
+
+#include <cmath>
+
+// Numeric type of the simulation core, picked per build target (see
+// build.sh):
+//   default    float throughout, for throughput
+//   RV_DOUBLE  double throughout, for accuracy checks
+#ifdef RV_DOUBLE
+typedef double real;
+#else
+typedef float real;
+#endif
+
+// Plain 3-vector: three packed components, no virtuals, all ops inline, so
+// arrays of them can be streamed and vectorized. Method names follow
+// irrlicht's vector3d, which the renderer adapter converts to.
+template<class T> struct vec3T {
+  T X, Y, Z;
+
+  vec3T() : X(0), Y(0), Z(0) {}
+  vec3T(T x, T y, T z) : X(x), Y(y), Z(z) {}
+
+  vec3T operator+(const vec3T &o) const { return vec3T(X+o.X, Y+o.Y, Z+o.Z); }
+  vec3T operator-(const vec3T &o) const { return vec3T(X-o.X, Y-o.Y, Z-o.Z); }
+  vec3T operator-() const { return vec3T(-X, -Y, -Z); }
+  vec3T operator*(T s) const { return vec3T(X*s, Y*s, Z*s); }
+  vec3T operator/(T s) const { return vec3T(X/s, Y/s, Z/s); }
+
+  vec3T& operator+=(const vec3T &o) {
+    X += o.X; Y += o.Y; Z += o.Z;
+    return *this;
+  }
+  vec3T& operator-=(const vec3T &o) {
+    X -= o.X; Y -= o.Y; Z -= o.Z;
+    return *this;
+  }
+  vec3T& operator*=(T s) {
+    X *= s; Y *= s; Z *= s;
+    return *this;
+  }
+
+  bool operator==(const vec3T &o) const {
+    return X == o.X && Y == o.Y && Z == o.Z;
+  }
+  bool operator!=(const vec3T &o) const { return !(*this == o); }
+  // Lexicographic, for use as a map key
+  bool operator<(const vec3T &o) const {
+    return X < o.X || (X == o.X && (Y < o.Y || (Y == o.Y && Z < o.Z)));
+  }
+
+  T getLengthSQ() const { return X*X + Y*Y + Z*Z; }
+  T getLength() const { return std::sqrt(X*X + Y*Y + Z*Z); }
+  T dotProduct(const vec3T &o) const { return X*o.X + Y*o.Y + Z*o.Z; }
+  vec3T crossProduct(const vec3T &o) const {
+    return vec3T(Y*o.Z - Z*o.Y, Z*o.X - X*o.Z, X*o.Y - Y*o.X);
+  }
+
+  // Normalize in place, leaving zero vectors alone
+  vec3T& normalize() {
+    double lSq = X*X + Y*Y + Z*Z;
+    if (lSq == 0) return *this;
+    double inv = 1.0 / std::sqrt(lSq);
+    X = (T)(X * inv);
+    Y = (T)(Y * inv);
+    Z = (T)(Z * inv);
+    return *this;
+  }
+};
+
+template<class S, class T> vec3T<T> operator*(S s, const vec3T<T> &v) {
+  return v * (T)s;
+}
+
+typedef vec3T<real> vec3;
+typedef vec3T<int> ivec3;
+
+// Rotation quaternion. Keeps irrlicht's conventions (W is the scalar part,
+// and a*b is the Hamilton product b.a) so rotations match the renderer.
+struct quat {
+  real X, Y, Z, W;
+
+  quat() : X(0), Y(0), Z(0), W(1) {}
+  quat(real x, real y, real z, real w) : X(x), Y(y), Z(z), W(w) {}
+
+  quat operator*(const quat &o) const {
+    return quat(o.W*X + o.X*W + o.Y*Z - o.Z*Y,
+                o.W*Y + o.Y*W + o.Z*X - o.X*Z,
+                o.W*Z + o.Z*W + o.X*Y - o.Y*X,
+                o.W*W - o.X*X - o.Y*Y - o.Z*Z);
+  }
+
+  // Inverse of a unit quaternion
+  quat& makeInverse() {
+    X = -X;
+    Y = -Y;
+    Z = -Z;
+    return *this;
+  }
+
+  // axis must be unit length
+  quat& fromAngleAxis(real angle, const vec3 &axis) {
+    real s = sin(angle/2);
+    W = cos(angle/2);
+    X = s*axis.X;
+    Y = s*axis.Y;
+    Z = s*axis.Z;
+    return *this;
+  }
+
+  // Set to the shortest-arc interpolation from a (t=0) to b (t=1)
+  quat& slerp(quat a, const quat &b, real t) {
+    real d = a.X*b.X + a.Y*b.Y + a.Z*b.Z + a.W*b.W;
+    if (d < 0) {
+      a = quat(-a.X, -a.Y, -a.Z, -a.W);
+      d = -d;
+    }
+    real s0 = 1 - t, s1 = t;
+    if (d < (real)0.9995) { // Nearly parallel falls back to lerp
+      real theta = acos(d);
+      real inv = 1 / sin(theta);
+      s0 = sin((1 - t)*theta) * inv;
+      s1 = sin(t*theta) * inv;
+    }
+    X = s0*a.X + s1*b.X;
+    Y = s0*a.Y + s1*b.Y;
+    Z = s0*a.Z + s1*b.Z;
+    W = s0*a.W + s1*b.W;
+    real len = sqrt(X*X + Y*Y + Z*Z + W*W);
+    X /= len; Y /= len; Z /= len; W /= len;
+    return *this;
+  }
+};
+
+#endif
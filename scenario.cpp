@@ -0,0 +1,568 @@
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <random>
+#include <thread>
+#include <algorithm>
+#include <cstdlib>
+
+#include "scenario.h"
+
+// Scenario files are line based, '#' starts a comment:
+//
+//   timestep 0.03
+//   gravity 0 -9.8 0
+//   params k 10 eta 0.01 kt 0.1        # contact model, any subset
+//   template rod                       # explicit particle offsets
+//     part 0 0.5 0
+//     part 0 -0.5 0
+//   end
+//   template cube box 4 4 4            # block of parts at PART_D spacing
+//   template ball sphere 1.5           # solid sphere of parts
+//   template queen mesh queen.obj 0.1  # OBJ surface, scaled and voxelized
+//   plane pos 0 -2 0 norm 0 1 0 right 1 0 0 size 6 6
+//   body rod pos 0 3 0 rot 1 0 0 90 vel 0 -1 0 spin 0 0 0 fixed
+//   grid cube pos 0 0 0 count 10 10 10 spacing 2.5
+//   pour rod min -5 5 -5 max 5 20 5 count 100000 seed 7 speed 1.0
+//   stack cube pos 0 0 0 count 20 gap 0.1
+//   joint ball 0 1 at 0 2 0 k 20 eta 0.5 break 50
+//   joint hinge 0 1 at 0 2 0 axis 0 0 1
+//   joint distance 0 1 at 0 2 0 to 0 3 0
+//   bond 0 1 reach 0.5 k 10 eta 0.2 break 1
+//   bond all reach 0.5 break 1
+//
+// Emitters (grid, pour, stack) take the same pose options as body; pos is the
+// emitter origin and the rest apply to every instance. Rotations are given as
+// axis and angle in degrees. Bodies are only built once the whole file has
+// been read, in parallel across all cores.
+//
+// Joints and bonds name bodies by the order this file creates them, from 0,
+// and take their points in world space at the bodies' starting pose. Bonds
+// join parts of different bodies within reach of each other (at most PART_D)
+// with breakable distance joints; k, eta and break are optional everywhere.
+
+namespace {
+
+typedef map< string, vector<double> > Opts;
+
+struct Template {
+  string name;
+  vector<vec3> locs;
+  vec3 lo, hi; // Extent of locs
+};
+
+struct Pose {
+  vec3 pos;
+  vec3 v;
+  quat theta;
+  vec3 w;
+  bool fixed = false;
+};
+
+struct Instance {
+  int tmpl;
+  Pose pose;
+};
+
+// A joint or bond line, made once bodies are built. a < 0 bonds all.
+struct JointSpec {
+  string cmd;
+  JointType type = BALL;
+  int a, b;
+  vec3 at, to, axis;
+  double reach = 0;
+  Joint proto;
+};
+
+bool isNumber(const string &tok) {
+  char *end;
+  strtod(tok.c_str(), &end);
+  return !tok.empty() && *end == '\0';
+}
+
+// Split "key n n n key key n ..." into opts
+bool parseOpts(istringstream &in, Opts &opts, string &bad) {
+  string tok, key;
+  while (in >> tok) {
+    if (isNumber(tok)) {
+      if (key.empty()) {
+        bad = tok;
+        return false;
+      }
+      opts[key].push_back(atof(tok.c_str()));
+    }
+    else {
+      key = tok;
+      opts[key];
+    }
+  }
+  return true;
+}
+
+struct Parser {
+  string path;
+  string dir;
+  int line = 0;
+
+  vector<Template> templates;
+  vector<Instance> instances;
+  vector<JointSpec> jointSpecs;
+  Template *open = nullptr; // Template with an explicit part list being read
+
+  int fail(const string &msg) {
+    cerr << path << ":" << line << ": " << msg << endl;
+    return 1;
+  }
+
+  int findTemplate(const string &name) {
+    for (int i = 0; i < templates.size(); ++i) {
+      if (templates[i].name == name) return i;
+    }
+    return -1;
+  }
+
+  // Fetch a vector option, checking arity. Missing options keep def.
+  bool vec(const Opts &opts, const char *key, vec3 &out) {
+    auto it = opts.find(key);
+    if (it == opts.end()) return true;
+    if (it->second.size() != 3) return false;
+    out = vec3(it->second[0], it->second[1], it->second[2]);
+    return true;
+  }
+
+  template<class T> bool num(const Opts &opts, const char *key, T &out) {
+    auto it = opts.find(key);
+    if (it == opts.end()) return true;
+    if (it->second.size() != 1) return false;
+    out = it->second[0];
+    return true;
+  }
+
+  bool pose(const Opts &opts, Pose &p) {
+    if (!vec(opts, "pos", p.pos) || !vec(opts, "vel", p.v) ||
+        !vec(opts, "spin", p.w)) return false;
+    auto rot = opts.find("rot");
+    if (rot != opts.end()) {
+      if (rot->second.size() != 4) return false;
+      vec3 axis(rot->second[0], rot->second[1], rot->second[2]);
+      axis.normalize();
+      p.theta.fromAngleAxis(rot->second[3] * M_PI / 180.0, axis);
+    }
+    p.fixed = opts.count("fixed");
+    return true;
+  }
+
+  int finishTemplate(Template &t) {
+    t.lo = t.hi = t.locs.empty() ? vec3(0,0,0) : t.locs[0];
+    for (const vec3 &l : t.locs) {
+      if (!Obj::fits(l)) {
+        return fail("template " + t.name + " has a part too far from its "
+                    "center for this build");
+      }
+      t.lo.X = min(t.lo.X, l.X); t.hi.X = max(t.hi.X, l.X);
+      t.lo.Y = min(t.lo.Y, l.Y); t.hi.Y = max(t.hi.Y, l.Y);
+      t.lo.Z = min(t.lo.Z, l.Z); t.hi.Z = max(t.hi.Z, l.Z);
+    }
+    return 0;
+  }
+
+  // Voxelize the triangles of an OBJ file, or its vertices if it has no
+  // faces, keeping one part per PART_D cell touched
+  int loadMesh(Template &t, const string &file, double scale) {
+    string full = (file.size() && file[0] == '/') ? file : dir + file;
+    ifstream in(full);
+    if (!in) return fail("cannot open mesh " + full);
+    map< ivec3, int > cells;
+    vec3 sum(0,0,0);
+    auto add = [&](const vec3 &p) {
+      ivec3 c((int)floor(p.X/PART_D), (int)floor(p.Y/PART_D),
+              (int)floor(p.Z/PART_D));
+      if (cells.count(c)) return;
+      cells[c] = 1;
+      vec3 l((c.X+0.5)*PART_D, (c.Y+0.5)*PART_D, (c.Z+0.5)*PART_D);
+      t.locs.push_back(l);
+      sum += l;
+    };
+
+    vector<vec3> verts;
+    bool faces = false;
+    string ln;
+    while (getline(in, ln)) {
+      if (ln.size() < 2 || ln[1] != ' ') continue;
+      istringstream ls(ln.substr(2));
+      if (ln[0] == 'v') {
+        double x, y, z;
+        if (ls >> x >> y >> z) verts.push_back(vec3(x, y, z) * scale);
+        continue;
+      }
+      if (ln[0] != 'f') continue;
+      // Corners are v, v/vt, v//vn or v/vt/vn, negative counting back
+      vector<int> corner;
+      string tok;
+      while (ls >> tok) {
+        int v = atoi(tok.c_str());
+        if (v < 0) v += verts.size();
+        else --v;
+        if (v < 0 || v >= verts.size()) return fail("bad face in " + full);
+        corner.push_back(v);
+      }
+      if (corner.size() < 3) return fail("bad face in " + full);
+      faces = true;
+      // Fan into triangles, sampled finely enough to touch every cell they
+      // pass through
+      for (int k = 1; k + 1 < corner.size(); ++k) {
+        vec3 a = verts[corner[0]];
+        vec3 ab = verts[corner[k]] - a, ac = verts[corner[k+1]] - a;
+        real edge = max(max(ab.getLength(), ac.getLength()),
+                        (ac - ab).getLength());
+        int n = (int)ceil(edge / (PART_D/2)) + 1;
+        for (int i = 0; i <= n; ++i) {
+          for (int j = 0; i + j <= n; ++j) {
+            add(a + ab*(i/(real)n) + ac*(j/(real)n));
+          }
+        }
+      }
+    }
+    if (!faces) {
+      for (const vec3 &v : verts) add(v);
+    }
+    if (t.locs.empty()) return fail("no vertices in mesh " + full);
+    // Center on the centroid so pos is the center of mass
+    vec3 c = sum / (double)t.locs.size();
+    for (vec3 &l : t.locs) l -= c;
+    return 0;
+  }
+
+  int parseTemplate(istringstream &in) {
+    Template t;
+    string kind;
+    if (!(in >> t.name)) return fail("template needs a name");
+    if (findTemplate(t.name) >= 0) return fail("duplicate template " + t.name);
+    if (!(in >> kind)) {
+      // Explicit part list follows
+      templates.push_back(t);
+      open = &templates.back();
+      return 0;
+    }
+    if (kind == "box") {
+      int nx, ny, nz;
+      if (!(in >> nx >> ny >> nz) || nx < 1 || ny < 1 || nz < 1) {
+        return fail("box needs three positive counts");
+      }
+      for (int i = 0; i < nx; ++i) {
+        for (int j = 0; j < ny; ++j) {
+          for (int k = 0; k < nz; ++k) {
+            t.locs.push_back(vec3((i - (nx-1)/2.0) * PART_D,
+                                  (j - (ny-1)/2.0) * PART_D,
+                                  (k - (nz-1)/2.0) * PART_D));
+          }
+        }
+      }
+    }
+    else if (kind == "sphere") {
+      double r;
+      if (!(in >> r) || r < 0) return fail("sphere needs a radius");
+      int n = (int)(r / PART_D);
+      for (int i = -n; i <= n; ++i) {
+        for (int j = -n; j <= n; ++j) {
+          for (int k = -n; k <= n; ++k) {
+            vec3 l(i*PART_D, j*PART_D, k*PART_D);
+            if (l.getLengthSQ() <= r*r) t.locs.push_back(l);
+          }
+        }
+      }
+    }
+    else if (kind == "mesh") {
+      string file;
+      double scale = 1.0;
+      if (!(in >> file)) return fail("mesh needs a file");
+      in >> scale;
+      if (loadMesh(t, file, scale)) return 1;
+    }
+    else {
+      return fail("unknown template kind " + kind);
+    }
+    if (finishTemplate(t)) return 1;
+    templates.push_back(t);
+    return 0;
+  }
+
+  int parsePlane(istringstream &in, World &world) {
+    Opts opts;
+    string bad;
+    if (!parseOpts(in, opts, bad)) return fail("unexpected " + bad);
+    Plane *p = new Plane();
+    auto size = opts.find("size");
+    if (size == opts.end() || size->second.size() != 2) {
+      delete p;
+      return fail("plane needs size w h");
+    }
+    p->width = size->second[0];
+    p->height = size->second[1];
+    if (!vec(opts, "pos", p->pos) || !vec(opts, "norm", p->norm) ||
+        !vec(opts, "right", p->right)) {
+      delete p;
+      return fail("bad plane vector");
+    }
+    if (p->norm.getLengthSQ() == 0 || p->right.getLengthSQ() == 0 ||
+        p->norm.crossProduct(p->right).getLengthSQ() == 0) {
+      delete p;
+      return fail("plane needs nonzero norm and right, not parallel");
+    }
+    world.planes.push_back(p);
+    return 0;
+  }
+
+  int parseBody(const string &cmd, istringstream &in) {
+    string name;
+    if (!(in >> name)) return fail(cmd + " needs a template");
+    int ti = findTemplate(name);
+    if (ti < 0) return fail("unknown template " + name);
+    Opts opts;
+    string bad;
+    if (!parseOpts(in, opts, bad)) return fail("unexpected " + bad);
+    Pose base;
+    if (!pose(opts, base)) return fail("bad pose option");
+    const Template &t = templates[ti];
+
+    if (cmd == "body") {
+      instances.push_back({ti, base});
+    }
+    else if (cmd == "grid") {
+      auto count = opts.find("count");
+      if (count == opts.end() || count->second.size() != 3) {
+        return fail("grid needs count nx ny nz");
+      }
+      double spacing = max(max(t.hi.X - t.lo.X, t.hi.Y - t.lo.Y),
+                           t.hi.Z - t.lo.Z) + 2*PART_D;
+      if (!num(opts, "spacing", spacing)) return fail("bad spacing");
+      for (int i = 0; i < count->second[0]; ++i) {
+        for (int j = 0; j < count->second[1]; ++j) {
+          for (int k = 0; k < count->second[2]; ++k) {
+            Pose p = base;
+            p.pos += vec3(i, j, k) * spacing;
+            instances.push_back({ti, p});
+          }
+        }
+      }
+    }
+    else if (cmd == "pour") {
+      vec3 lo = base.pos, hi = base.pos;
+      double n = 0, seed = 0, speed = 0;
+      if (!vec(opts, "min", lo) || !vec(opts, "max", hi) ||
+          !num(opts, "count", n) || !num(opts, "seed", seed) ||
+          !num(opts, "speed", speed)) return fail("bad pour option");
+      // Generated serially so the result does not depend on thread count
+      mt19937 rng((unsigned)seed);
+      uniform_real_distribution<double> u(0.0, 1.0);
+      for (int i = 0; i < n; ++i) {
+        Pose p = base;
+        p.pos = vec3(lo.X + (hi.X-lo.X)*u(rng), lo.Y + (hi.Y-lo.Y)*u(rng),
+                     lo.Z + (hi.Z-lo.Z)*u(rng));
+        vec3 axis(u(rng) - 0.5, u(rng) - 0.5, u(rng) - 0.5);
+        axis.normalize();
+        p.theta.fromAngleAxis(2*M_PI*u(rng), axis);
+        vec3 dir(u(rng) - 0.5, u(rng) - 0.5, u(rng) - 0.5);
+        dir.normalize();
+        p.v += dir * speed;
+        instances.push_back({ti, p});
+      }
+    }
+    else if (cmd == "stack") {
+      double n = 0, gap = 0;
+      if (!num(opts, "count", n) || !num(opts, "gap", gap)) {
+        return fail("bad stack option");
+      }
+      double height = t.hi.Y - t.lo.Y + PART_D + gap;
+      for (int i = 0; i < n; ++i) {
+        Pose p = base;
+        p.pos.Y += i * height;
+        instances.push_back({ti, p});
+      }
+    }
+    return 0;
+  }
+
+  int parseJoint(const string &cmd, istringstream &in) {
+    JointSpec js;
+    js.cmd = cmd;
+    if (cmd == "joint") {
+      string kind;
+      in >> kind;
+      if (kind == "ball") js.type = BALL;
+      else if (kind == "hinge") js.type = HINGE;
+      else if (kind == "distance") js.type = DISTANCE;
+      else return fail("joint needs ball, hinge or distance");
+    }
+    string first;
+    if (!(in >> first)) return fail(cmd + " needs two bodies");
+    if (cmd == "bond" && first == "all") {
+      js.a = js.b = -1;
+    }
+    else {
+      js.a = atoi(first.c_str());
+      if (!isNumber(first) || !(in >> js.b)) {
+        return fail(cmd + " needs two bodies");
+      }
+      int n = instances.size();
+      if (js.a < 0 || js.b < 0 || js.a >= n || js.b >= n || js.a == js.b) {
+        return fail(cmd + " needs two different bodies made above");
+      }
+    }
+
+    Opts opts;
+    string bad;
+    if (!parseOpts(in, opts, bad)) return fail("unexpected " + bad);
+    if (!num(opts, "k", js.proto.k) || !num(opts, "eta", js.proto.eta) ||
+        !num(opts, "break", js.proto.breakForce)) {
+      return fail("bad " + cmd + " option");
+    }
+    if (cmd == "bond") {
+      if (!num(opts, "reach", js.reach) || js.reach <= 0) {
+        return fail("bond needs reach");
+      }
+    }
+    else {
+      if (!opts.count("at") || !vec(opts, "at", js.at)) {
+        return fail("joint needs at x y z");
+      }
+      if (js.type == DISTANCE && (!opts.count("to") ||
+                                  !vec(opts, "to", js.to))) {
+        return fail("distance joint needs to x y z");
+      }
+      if (js.type == HINGE && (!opts.count("axis") ||
+                               !vec(opts, "axis", js.axis))) {
+        return fail("hinge needs axis x y z");
+      }
+    }
+    jointSpecs.push_back(js);
+    return 0;
+  }
+
+  // Once bodies are built, base being the index of the first
+  void makeJoints(World &world, size_t base) {
+    for (const JointSpec &js : jointSpecs) {
+      Obj *a = js.a < 0 ? nullptr : world.objects[base + js.a];
+      Obj *b = js.b < 0 ? nullptr : world.objects[base + js.b];
+      if (js.cmd == "bond") {
+        world.bond(js.proto, js.reach, a, b);
+        continue;
+      }
+      Joint j;
+      if (js.type == BALL) j = Joint::ball(a, b, js.at);
+      else if (js.type == HINGE) j = Joint::hinge(a, b, js.at, js.axis);
+      else j = Joint::distance(a, b, js.at, js.to);
+      j.k = js.proto.k;
+      j.eta = js.proto.eta;
+      j.breakForce = js.proto.breakForce;
+      world.joints.add(j);
+    }
+  }
+
+  int parse(istream &in, World &world) {
+    string ln;
+    while (getline(in, ln)) {
+      ++line;
+      size_t hash = ln.find('#');
+      if (hash != string::npos) ln.resize(hash);
+      istringstream ls(ln);
+      string cmd;
+      if (!(ls >> cmd)) continue;
+
+      if (open) {
+        if (cmd == "end") {
+          if (finishTemplate(*open)) return 1;
+          open = nullptr;
+          continue;
+        }
+        double x, y, z;
+        if (cmd != "part" || !(ls >> x >> y >> z)) {
+          return fail("expected part x y z or end");
+        }
+        open->locs.push_back(vec3(x, y, z));
+        continue;
+      }
+
+      int err = 0;
+      if (cmd == "timestep") {
+        if (!(ls >> world.ts) || world.ts <= 0) err = fail("bad timestep");
+      }
+      else if (cmd == "gravity") {
+        double x, y, z;
+        if (!(ls >> x >> y >> z)) err = fail("gravity needs x y z");
+        else world.gravity = vec3(x, y, z);
+      }
+      else if (cmd == "params") {
+        Opts opts;
+        string bad;
+        if (!parseOpts(ls, opts, bad)) err = fail("unexpected " + bad);
+        else if (!num(opts, "k", world.params.k) ||
+                 !num(opts, "eta", world.params.eta) ||
+                 !num(opts, "kt", world.params.kt)) err = fail("bad params");
+      }
+      else if (cmd == "template") err = parseTemplate(ls);
+      else if (cmd == "plane") err = parsePlane(ls, world);
+      else if (cmd == "body" || cmd == "grid" || cmd == "pour" ||
+               cmd == "stack") err = parseBody(cmd, ls);
+      else if (cmd == "joint" || cmd == "bond") err = parseJoint(cmd, ls);
+      else err = fail("unknown command " + cmd);
+      if (err) return err;
+    }
+    if (open) return fail("template " + open->name + " missing end");
+    return 0;
+  }
+};
+
+void buildRange(const vector<Template> &templates,
+                const vector<Instance> &instances,
+                Obj **out, size_t begin, size_t end) {
+  for (size_t i = begin; i < end; ++i) {
+    const Instance &inst = instances[i];
+    const Template &t = templates[inst.tmpl];
+    Obj *o = new Obj();
+    o->reserve(t.locs.size());
+    for (const vec3 &l : t.locs) {
+      o->addPart(l);
+    }
+    o->pos = inst.pose.pos;
+    o->v = inst.pose.v;
+    o->theta = inst.pose.theta;
+    o->w = inst.pose.w;
+    o->fixed = inst.pose.fixed;
+    out[i] = o;
+  }
+}
+
+} // anonymous namespace
+
+int loadScenario(const char *path, World &world) {
+  ifstream in(path);
+  if (!in) {
+    cerr << "Cannot open scenario " << path << endl;
+    return 1;
+  }
+  Parser parser;
+  parser.path = path;
+  size_t slash = parser.path.rfind('/');
+  if (slash != string::npos) parser.dir = parser.path.substr(0, slash+1);
+  int err = parser.parse(in, world);
+  if (err) return err;
+
+  // Build bodies in parallel, each thread filling a contiguous range
+  size_t base = world.objects.size();
+  size_t n = parser.instances.size();
+  world.objects.resize(base + n);
+  size_t nthreads = max(1u, thread::hardware_concurrency());
+  nthreads = min(nthreads, max((size_t)1, n / 64));
+  vector<thread> threads;
+  for (size_t t = 0; t < nthreads; ++t) {
+    size_t begin = n * t / nthreads;
+    size_t end = n * (t+1) / nthreads;
+    threads.push_back(thread(buildRange, cref(parser.templates),
+                             cref(parser.instances),
+                             world.objects.data() + base, begin, end));
+  }
+  for (thread &t : threads) t.join();
+  parser.makeJoints(world, base);
+  return 0;
+}
@@ -0,0 +1,10 @@
+#ifndef SCENARIO_H
+#define SCENARIO_H
+
+#include "world.h"
+
+// Load a scenario file into world. Returns 0 on success, otherwise reports
+// the offending line on cerr and returns nonzero.
+int loadScenario(const char *path, World &world);
+
+#endif
@@ -0,0 +1,64 @@
+#include <algorithm>
+
+#include "taskgraph.h"
+
+TaskPool::TaskPool(int nthreads) {
+  if (nthreads <= 0) nthreads = max(1u, thread::hardware_concurrency());
+  for (int i = 1; i < nthreads; ++i) {
+    workers.push_back(thread([this] { work(); }));
+  }
+}
+
+TaskPool::~TaskPool() {
+  {
+    lock_guard<mutex> lock(m);
+    quit = true;
+  }
+  cv.notify_all();
+  for (thread &t : workers) t.join();
+}
+
+void TaskPool::run(TaskGraph &g) {
+  unique_lock<mutex> lock(m);
+  graph = &g;
+  remaining = g.tasks.size();
+  pending.resize(g.tasks.size());
+  for (int i = 0; i < g.tasks.size(); ++i) {
+    pending[i] = g.tasks[i].deps;
+    if (pending[i] == 0) ready.push_back(i);
+  }
+  cv.notify_all();
+
+  // Work alongside the pool until the graph is done
+  while (remaining > 0) {
+    if (!runOne(lock)) cv.wait(lock);
+  }
+  graph = nullptr;
+}
+
+void TaskPool::work() {
+  unique_lock<mutex> lock(m);
+  while (!quit) {
+    if (!runOne(lock)) cv.wait(lock);
+  }
+}
+
+// Run a ready task, if there is one, with the lock released meanwhile
+bool TaskPool::runOne(unique_lock<mutex> &lock) {
+  if (ready.empty()) return false;
+  int id = ready.front();
+  ready.pop_front();
+  lock.unlock();
+  graph->tasks[id].f();
+  lock.lock();
+
+  bool wake = false;
+  for (int n : graph->tasks[id].next) {
+    if (--pending[n] == 0) {
+      ready.push_back(n);
+      wake = true;
+    }
+  }
+  if (--remaining == 0 || wake) cv.notify_all();
+  return true;
+}
@@ -0,0 +1,120 @@
+#ifndef TASKGRAPH_H
+#define TASKGRAPH_H
+
+#include <vector>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+using namespace std;
+
+// Work items with explicit dependencies. Each task may start as soon as every
+// task it depends on has finished, with no barrier between stages.
+struct TaskGraph {
+  struct Task {
+    function<void()> f;
+    vector<int> next; // Tasks depending on this one
+    int deps;
+  };
+  vector<Task> tasks;
+
+  // Returns the new task's id, for use in later deps. Deps must already
+  // have been added.
+  int add(function<void()> f, const vector<int> &deps = vector<int>()) {
+    int id = tasks.size();
+    tasks.push_back({f, vector<int>(), (int)deps.size()});
+    for (int d : deps) tasks[d].next.push_back(id);
+    return id;
+  }
+};
+
+// Threads that run task graphs. They sleep between graphs, so one pool can
+// serve every step of a run.
+struct TaskPool {
+  // nthreads includes the thread calling run; <= 0 uses all cores
+  TaskPool(int nthreads);
+  TaskPool(const TaskPool&) = delete;
+  TaskPool& operator=(const TaskPool&) = delete;
+  ~TaskPool();
+
+  int size() const { return workers.size() + 1; }
+
+  // Run every task of g, returning once all have finished
+  void run(TaskGraph &g);
+
+private:
+  vector<thread> workers;
+  mutex m;
+  condition_variable cv;
+  bool quit = false;
+
+  // State of the graph being run, guarded by m
+  TaskGraph *graph = nullptr;
+  vector<int> pending; // Unfinished deps per task
+  deque<int> ready;
+  int remaining = 0;
+
+  void work();
+  bool runOne(unique_lock<mutex> &lock);
+};
+
+// Hands values to a background thread that consumes them in order, so the
+// output of one step is written while the next one computes. Fill next(),
+// then submit; submit only waits if the previous value is still being
+// consumed.
+template<class T> struct AsyncSink {
+  AsyncSink(function<void(const T&)> consume) : consume(consume) {
+    worker = thread([this] { work(); });
+  }
+  AsyncSink(const AsyncSink&) = delete;
+  AsyncSink& operator=(const AsyncSink&) = delete;
+  ~AsyncSink() {
+    {
+      unique_lock<mutex> lock(m);
+      cv.wait(lock, [this] { return !full; });
+      quit = true;
+    }
+    cv.notify_all();
+    worker.join();
+  }
+
+  T& next() { return bufs[cur]; }
+
+  void submit() {
+    {
+      unique_lock<mutex> lock(m);
+      cv.wait(lock, [this] { return !full; });
+      full = true;
+      cur ^= 1;
+    }
+    cv.notify_all();
+  }
+
+private:
+  function<void(const T&)> consume;
+  T bufs[2];
+  int cur = 0; // Producer's buffer; the consumer reads the other
+  bool full = false;
+  bool quit = false;
+  mutex m;
+  condition_variable cv;
+  thread worker;
+
+  void work() {
+    unique_lock<mutex> lock(m);
+    while (true) {
+      cv.wait(lock, [this] { return full || quit; });
+      if (!full) return;
+      const T &v = bufs[cur ^ 1];
+      lock.unlock();
+      consume(v);
+      lock.lock();
+      full = false;
+      cv.notify_all();
+    }
+  }
+};
+
+#endif
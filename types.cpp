@@ -1,25 +1,56 @@
 #include "types.h"
 
-using namespace irr::core;
+namespace {
+
+// Bodies by id then part index, planes after all bodies
+uint64_t sortKey(CollObj *o) {
+  if (o->getType() == PART) {
+    Particle *p = (Particle *) o;
+    return ((uint64_t)(uint32_t)p->parent->id << 32) | (uint32_t)p->index;
+  }
+  return (0xffffffffull << 32) | (uint32_t)((Plane *) o)->id;
+}
+
+struct Keyed {
+  uint64_t k1, k2;
+  Collision c;
+
+  bool operator<(const Keyed &o) const {
+    return k1 < o.k1 || (k1 == o.k1 && k2 < o.k2);
+  }
+};
+
+} // anonymous namespace
+
+void Collision::sortCanonical(vector<Collision> &cs) {
+  vector<Keyed> keyed(cs.size());
+  for (int i = 0; i < cs.size(); ++i) {
+    keyed[i] = {sortKey(cs[i].o1), sortKey(cs[i].o2), cs[i]};
+  }
+  sort(keyed.begin(), keyed.end());
+  for (int i = 0; i < cs.size(); ++i) {
+    cs[i] = keyed[i].c;
+  }
+}
 
 
-void Collision::applyForces() {
+void Collision::applyForces(const Params &p) {
   int collType = o1->getType() | o2->getType();
   if (collType == PART) {
-    applyPartPart();
+    applyPartPart(p);
   }
   else if (collType == (PART | PLANE)) {
-    applyPlanePart();
+    applyPlanePart(p);
   }
 }
 
-void Collision::applyPartPart() {
+void Collision::applyPartPart(const Params &p) {
   Particle* p1 = (Particle *) o1;
   Particle* p2 = (Particle *) o2;
 
   // Ensure particles actually intersect
-  vector3df d = p1->pos - p2->pos;
-  double dSq = d.getLengthSQ();
+  vec3 d = p1->pos - p2->pos;
+  real dSq = d.getLengthSQ();
   if (dSq > PART_D*PART_D) {
     return;
   }
@@ -28,29 +59,31 @@ void Collision::applyPartPart() {
   if (p1->parent == p2->parent) return;
 
   // R is vector from p2 to p1
-  vector3df r = p1->pos - p2->pos;
-  double rad = r.getLength();
-  vector3df rhat = r.normalize();
+  vec3 r = p1->pos - p2->pos;
+  real rad = r.getLength();
+  vec3 rhat = r.normalize();
 
-  vector3df f1(0,0,0);
-  vector3df f2(0,0,0);
+  vec3 f1(0,0,0);
+  vec3 f2(0,0,0);
 
   // Spring model
-  double spMag = -k*(PART_D - rad);
+  real spMag = -p.k*(PART_D - rad);
   f1 -= spMag*rhat;
   f2 += spMag*rhat;
 
   // Damping model
-  f1 += p1->v*eta;
-  f2 += p2->v*eta;
+  vec3 v1 = p1->vel();
+  vec3 v2 = p2->vel();
+  f1 += v1*p.eta;
+  f2 += v2*p.eta;
 
   // Shear force
-  double vrdot1 = p1->v.dotProduct(rhat);
-  double vrdot2 = p2->v.dotProduct(rhat);
-  vector3df vt1 = p1->v - vrdot1*rhat;
-  vector3df vt2 = p2->v - vrdot2*rhat;
-  f1 -= kt*vt1;
-  f2 += kt*vt2;
+  real vrdot1 = v1.dotProduct(rhat);
+  real vrdot2 = v2.dotProduct(rhat);
+  vec3 vt1 = v1 - vrdot1*rhat;
+  vec3 vt2 = v2 - vrdot2*rhat;
+  f1 -= p.kt*vt1;
+  f2 += p.kt*vt2;
 
   // Update parent forces
   p1->parent->f += f1;
@@ -58,13 +91,13 @@ void Collision::applyPartPart() {
   int p1i = p1->index;
   int p2i = p2->index;
   // Torques
-  vector3df p1r = p1->pos - p1->parent->pos;
-  vector3df p2r = p2->pos - p2->parent->pos;
+  vec3 p1r = p1->pos - p1->parent->pos;
+  vec3 p2r = p2->pos - p2->parent->pos;
   p1->parent->t += p1r.crossProduct(f1);
   p2->parent->t += p2r.crossProduct(f2);
 }
 
-void Collision::applyPlanePart() {
+void Collision::applyPlanePart(const Params &p) {
 
   //cout << "plane part collision" << endl;
   Particle* part;
@@ -85,50 +118,51 @@ void Collision::applyPlanePart() {
   }
 
   // diff is vector from plane center to particle center
-  vector3df diff = plane->pos - part->pos;
+  vec3 diff = plane->pos - part->pos;
 
 
   // plane is defined by norm . (x, y, z)  = d with x, y, z relative to point
-  double d = diff.dotProduct(plane->norm);
+  real d = diff.dotProduct(plane->norm);
 
-  double normLength = (plane->norm.getLength());
+  real normLength = (plane->norm.getLength());
 
-  vector3df closestPoint = (plane->norm * d) / plane->norm.getLengthSQ();
+  vec3 closestPoint = (plane->norm * d) / plane->norm.getLengthSQ();
 
   // Put closestPoint back into world space
   closestPoint += part->pos;
 
   // R is vector from plane to part
-  vector3df r = part->pos - closestPoint;
+  vec3 r = part->pos - closestPoint;
 
   // If not actually colliding, return
   if (r.getLengthSQ() > PART_D*PART_D) {
     return;
   }
-  double rad = r.getLength();
-  vector3df rhat = r.normalize();
+  real rad = r.getLength();
+  vec3 rhat = r.normalize();
 
-  vector3df f(0,0,0);
+  vec3 f(0,0,0);
 
   // Spring model
-  double spMag = -k*(PART_D - rad);
+  real spMag = -p.k*(PART_D - rad);
   f -= spMag*rhat;
 
   // Damping model
-  f += part->v*eta;
+  vec3 v = part->vel();
+  f += v*p.eta;
 
   // Shear force
-  double vrdot = part->v.dotProduct(rhat);
-  vector3df vt = part->v - vrdot*rhat;
+  real vrdot = v.dotProduct(rhat);
+  vec3 vt = v - vrdot*rhat;
 
-  f -= kt*vt;
+  f -= p.kt*vt;
 
   // Update parent forces
   part->parent->f += f;
 
   int pi = part->index;
   // Torques
-  vector3df pr = part->pos - part->parent->pos;
+  vec3 pr = part->pos - part->parent->pos;
   part->parent->t += pr.crossProduct(f);
 }
 
@@ -3,26 +3,29 @@
 
 #include <vector>
 #include <map>
+#include <unordered_map>
+#include <cstdint>
+#include <climits>
 #include <cmath>
+#include <algorithm>
 #include <cassert>
 #include <iostream>
 
-#include <irrlicht/irrlicht.h>
-
+#include "rvmath.h"
 #include "util.h"
 
 using namespace std;
-using namespace irr::core;
 
-#define PART_D 0.5
-#define SIZE 100 // 10.0 x 10.0 x 10.0 region
+#define PART_D ((real)0.5)
+#define BRICK_BITS 3
+#define BRICK (1 << BRICK_BITS) // Cells per brick edge
 
-// Enclose all constant params
-namespace {
-const double k = 10.0;
-const double eta = 0.01;
-const double kt = 0.1;
-} // anonymous namespace
+// Contact model params, per world so batches can sweep them
+struct Params {
+  real k = 10.0; // Spring
+  real eta = 0.01; // Damping
+  real kt = 0.1; // Shear
+};
 
 struct Obj;
 
@@ -31,10 +34,13 @@ enum CollType {
   PLANE = PART << 1,
 };
 
+// Tagged rather than virtual, so particles carry no vtable pointer
 class CollObj {
 public:
-  vector3df pos;
-  virtual CollType getType() = 0;
+  vec3 pos;
+  CollType type;
+
+  CollType getType() const { return type; }
 };
 
 struct Collision {
@@ -42,58 +48,235 @@ struct Collision {
   CollObj *o1;
   CollObj *o2;
 
-  void applyForces();
+  void applyForces(const Params &p);
+
+  // Sort by the ids of the bodies, parts and planes involved, so forces are
+  // summed in the same order however the grid happened to be traversed
+  static void sortCanonical(vector<Collision> &cs);
 private:
-  void applyPartPart();
-  void applyPlanePart();
+  void applyPartPart(const Params &p);
+  void applyPlanePart(const Params &p);
 };
 
+// Sparse paged voxel grid. Cells are grouped into BRICK^3 bricks which are
+// allocated on demand and addressed by a hash of the brick coordinate, so
+// memory is only spent on the regions of the world that contain particles.
+// Within a brick only occupied cells have storage.
 struct Voxels {
-  std::map< vector3di, vector<CollObj*> > voxels;
+  typedef vector<CollObj*> Cell;
 
-  double xbase=0.0, ybase=0.0, zbase=0.0;
-  double size=PART_D;
+  struct Brick {
+    uint16_t slot[BRICK*BRICK*BRICK] = {}; // 1 + index into cells, 0 if empty
+    vector<int> occupied; // Indices of cells filled since the last clear
+    vector<Cell> cells; // Contents of occupied[k] in cells[k], kept on clear
 
-  void findCollisions(vector<Collision> &out) {
-    for (auto &kv : voxels) {
-      if (kv.second.size() > 1) {
-        // Collision!
-        //cout << "Found collision: " << kv.first << endl;
-        for (int i = 0; i < kv.second.size(); ++i) {
-          for (int j = i+1; j < kv.second.size(); ++j) {
-            CollObj *o1 = kv.second[0];
-            CollObj *o2 = kv.second[1];
+    Cell* at(int i) {
+      return slot[i] ? &cells[slot[i]-1] : nullptr;
+    }
+  };
+
+  unordered_map<uint64_t, Brick*> bricks;
+
+  real xbase=0.0, ybase=0.0, zbase=0.0;
+  real size=PART_D;
+  // Bounds of the cells occupied since the last clear, lo above hi if none
+  ivec3 cellLo = ivec3(INT_MAX, INT_MAX, INT_MAX);
+  ivec3 cellHi = ivec3(INT_MIN, INT_MIN, INT_MIN);
+
+  Voxels() {}
+  Voxels(const Voxels&) = delete;
+  Voxels& operator=(const Voxels&) = delete;
+  ~Voxels() {
+    for (auto &kv : bricks) delete kv.second;
+  }
+
+  // Floor-based quantization, so cells straddling zero are not double width
+  ivec3 cellOf(const vec3 &p) const {
+    return ivec3((int)floor((p.X-xbase) / size),
+                 (int)floor((p.Y-ybase) / size),
+                 (int)floor((p.Z-zbase) / size));
+  }
+
+  // Inclusive cell range covering the box [lo, hi], clipped to the occupied
+  // cells; false if it holds none. Safe for boxes far outside int range.
+  bool clip(const vec3 &lo, const vec3 &hi, ivec3 &clo, ivec3 &chi) const {
+    double l[3] = {lo.X - xbase, lo.Y - ybase, lo.Z - zbase};
+    double h[3] = {hi.X - xbase, hi.Y - ybase, hi.Z - zbase};
+    int bl[3] = {cellLo.X, cellLo.Y, cellLo.Z};
+    int bh[3] = {cellHi.X, cellHi.Y, cellHi.Z};
+    int *ol[3] = {&clo.X, &clo.Y, &clo.Z};
+    int *oh[3] = {&chi.X, &chi.Y, &chi.Z};
+    for (int a = 0; a < 3; ++a) {
+      double fl = floor(l[a] / size), fh = floor(h[a] / size);
+      if (!(fl <= bh[a] && fh >= bl[a])) return false;
+      *ol[a] = fl < bl[a] ? bl[a] : (int)fl;
+      *oh[a] = fh > bh[a] ? bh[a] : (int)fh;
+    }
+    return true;
+  }
+
+  // Pack brick coords into 21 bits each (+-1M bricks per axis)
+  static uint64_t brickKey(int bx, int by, int bz) {
+    const uint64_t mask = (1 << 21) - 1;
+    return ((uint64_t)(bx & mask) << 42) |
+        ((uint64_t)(by & mask) << 21) | (uint64_t)(bz & mask);
+  }
+  // Sign extend a 21-bit packed brick coord
+  static int unpack21(uint64_t bits) {
+    return (int32_t)((uint32_t)(bits & ((1 << 21) - 1)) << 11) >> 11;
+  }
+  static int cellIndex(const ivec3 &c) {
+    const int m = BRICK-1;
+    return ((c.X & m) * BRICK + (c.Y & m)) * BRICK + (c.Z & m);
+  }
+  static ivec3 cellCoord(uint64_t key, int index) {
+    int bx = unpack21(key >> 42);
+    int by = unpack21(key >> 21);
+    int bz = unpack21(key);
+    return ivec3(bx*BRICK + index / (BRICK*BRICK),
+                 by*BRICK + (index / BRICK) % BRICK,
+                 bz*BRICK + index % BRICK);
+  }
+
+  // Lookup without allocating, null if the brick does not exist
+  Cell* find(const ivec3 &c) const {
+    auto it = bricks.find(brickKey(c.X >> BRICK_BITS, c.Y >> BRICK_BITS,
+                                   c.Z >> BRICK_BITS));
+    if (it == bricks.end()) return nullptr;
+    return it->second->at(cellIndex(c));
+  }
+
+  void insert(const ivec3 &c, CollObj *o) {
+    Brick *&b = bricks[brickKey(c.X >> BRICK_BITS, c.Y >> BRICK_BITS,
+                                c.Z >> BRICK_BITS)];
+    if (!b) b = new Brick();
+    int i = cellIndex(c);
+    if (!b->slot[i]) {
+      int k = b->occupied.size();
+      b->occupied.push_back(i);
+      if (k == b->cells.size()) b->cells.emplace_back();
+      b->slot[i] = k+1;
+      cellLo = ivec3(min(cellLo.X, c.X), min(cellLo.Y, c.Y),
+                     min(cellLo.Z, c.Z));
+      cellHi = ivec3(max(cellHi.X, c.X), max(cellHi.Y, c.Y),
+                     max(cellHi.Z, c.Z));
+    }
+    b->cells[b->slot[i]-1].push_back(o);
+  }
 
+  // Call f on every occupied cell in the inclusive cell range [lo, hi],
+  // visiting whichever is smaller of the range or the allocated bricks
+  template<class F> void forEachIn(const ivec3 &lo, const ivec3 &hi,
+                                   F f) const {
+    ivec3 blo(lo.X >> BRICK_BITS, lo.Y >> BRICK_BITS, lo.Z >> BRICK_BITS);
+    ivec3 bhi(hi.X >> BRICK_BITS, hi.Y >> BRICK_BITS, hi.Z >> BRICK_BITS);
+    double nb = (double)(bhi.X-blo.X+1) * (bhi.Y-blo.Y+1) * (bhi.Z-blo.Z+1);
+    auto visit = [&](uint64_t key, const Brick *b) {
+      for (int k = 0; k < b->occupied.size(); ++k) {
+        ivec3 c = cellCoord(key, b->occupied[k]);
+        if (c.X < lo.X || c.Y < lo.Y || c.Z < lo.Z ||
+            c.X > hi.X || c.Y > hi.Y || c.Z > hi.Z) continue;
+        f(c, b->cells[k]);
+      }
+    };
+    if (nb > bricks.size()) {
+      for (auto &kv : bricks) visit(kv.first, kv.second);
+      return;
+    }
+    for (int bx = blo.X; bx <= bhi.X; ++bx) {
+      for (int by = blo.Y; by <= bhi.Y; ++by) {
+        for (int bz = blo.Z; bz <= bhi.Z; ++bz) {
+          uint64_t key = brickKey(bx, by, bz);
+          auto it = bricks.find(key);
+          if (it != bricks.end()) visit(key, it->second);
+        }
+      }
+    }
+  }
+
+  // Empty all cells, keeping storage for bricks that were used since the last
+  // clear and releasing the rest.
+  void clear() {
+    for (auto it = bricks.begin(); it != bricks.end(); ) {
+      Brick *b = it->second;
+      if (b->occupied.empty()) {
+        delete b;
+        it = bricks.erase(it);
+        continue;
+      }
+      for (int k = 0; k < b->occupied.size(); ++k) {
+        b->slot[b->occupied[k]] = 0;
+        b->cells[k].clear();
+      }
+      b->occupied.clear();
+      ++it;
+    }
+    cellLo = ivec3(INT_MAX, INT_MAX, INT_MAX);
+    cellHi = ivec3(INT_MIN, INT_MIN, INT_MIN);
+  }
+
+  // Bytes held by the grid, including cell storage kept across clears but
+  // not allocator overhead
+  size_t bytes() const {
+    size_t n = bricks.bucket_count()*sizeof(void*) +
+        bricks.size()*(sizeof(Brick) + sizeof(uint64_t) + 2*sizeof(void*));
+    for (auto &kv : bricks) {
+      n += kv.second->occupied.capacity()*sizeof(int) +
+          kv.second->cells.capacity()*sizeof(Cell);
+      for (const Cell &c : kv.second->cells) {
+        n += c.capacity()*sizeof(CollObj*);
+      }
+    }
+    return n;
+  }
+
+  void findCollisions(vector<Collision> &out) const {
+    for (auto &kv : bricks) {
+      findCollisions(kv.first, kv.second, out);
+    }
+  }
+
+  // Collisions found from the cells of one brick, which may reach into
+  // neighbouring bricks. Reads only, so bricks can be split across threads.
+  void findCollisions(uint64_t key, const Brick *b,
+                      vector<Collision> &out) const {
+    for (int oi = 0; oi < b->occupied.size(); ++oi) {
+      int ci = b->occupied[oi];
+      const Cell &cell = b->cells[oi];
+      if (cell.size() > 1) {
+        // Collision!
+        for (int i = 0; i < cell.size(); ++i) {
+          for (int j = i+1; j < cell.size(); ++j) {
             Collision c;
-            c.o1 = kv.second[0];
-            c.o2 = kv.second[1];
+            c.o1 = cell[i];
+            c.o2 = cell[j];
             out.push_back(c);
           }
         }
       }
-      else if (kv.second.size() == 1) {
-        CollObj *o1 = kv.second[0];
+      else if (cell.size() == 1) {
+        CollObj *o1 = cell[0];
         if (o1->getType() != PART) {
           // TODO: do planes need to check adjacent?
           continue;
         }
+        ivec3 at = cellCoord(key, ci);
         // Search adjacent
         for (int i = -1; i <= 1; ++i) {
           for (int j = -1; j <= 1; ++j) {
             for (int k = -1; k <= 1; ++k) {
               if (i == 0 && j == 0 && k == 0) continue;
-              auto loc = vector3di(kv.first.X+i, kv.first.Y+j, kv.first.Z+k);
-              if (voxels.count(loc)) {
-                for (CollObj *o2 : voxels[loc]) {
-                  vector3df d = o1->pos - o2->pos;
-                  double dSq = d.getLengthSQ();
-                  if (dSq < PART_D*PART_D) {
-                    // Collision!
-                    Collision c;
-                    c.o1 = o1;
-                    c.o2 = o2;
-                    out.push_back(c);
-                  }
+              Cell *adj = find(ivec3(at.X+i, at.Y+j, at.Z+k));
+              if (!adj) continue;
+              for (CollObj *o2 : *adj) {
+                vec3 d = o1->pos - o2->pos;
+                real dSq = d.getLengthSQ();
+                if (dSq < PART_D*PART_D) {
+                  // Collision!
+                  Collision c;
+                  c.o1 = o1;
+                  c.o2 = o2;
+                  out.push_back(c);
                 }
               }
             }
@@ -104,66 +287,63 @@ struct Voxels {
   }
 };
 
+// Inclusive range of cells
+struct CellBox {
+  ivec3 lo, hi;
+
+  bool contains(const ivec3 &c) const {
+    return c.X >= lo.X && c.Y >= lo.Y && c.Z >= lo.Z &&
+        c.X <= hi.X && c.Y <= hi.Y && c.Z <= hi.Z;
+  }
+};
+
+// RV_COMPACT builds drop the pushed velocity, deriving it from the body
+// instead, and keep body-relative offsets in 16 bits (see Obj::loc)
 struct Particle : CollObj {
-  vector3df v;
+#ifndef RV_COMPACT
+  vec3 v;
+#endif
   Obj *parent;
   int index;
 
-  // Draw debugging
-  vector3df l;
-  bool last = false;
-  void draw(double z, void (*pt)(double,double,double),
-            void (*ln)(double,double,double,double,double,double)) {
-    pt(pos.X, pos.Y, pos.Z);
-    if (last) {
-      ln(pos.X,pos.Y,pos.Z,l.X,l.Y,l.Z);
-    }
-    last = true;
-    l = pos;
-  }
+  Particle() { type = PART; }
 
-  CollType getType() {
-    return PART;
-  }
+  // Velocity as of the last push. RV_COMPACT builds compute it from the
+  // body's current v and w and this part's pushed pos instead, so there it
+  // follows velocity changes made since the push.
+  vec3 vel() const;
 };
 
 struct Plane : CollObj {
-  double width;
-  double height;
-  vector3df norm;
-  vector3df right;
+  int id = 0; // Index among the world's planes
+  real width;
+  real height;
+  vec3 norm;
+  vec3 right;
 
-  CollType getType() {
-    return PLANE;
-  }
+  Plane() { type = PLANE; }
 
   void dumpIntoVoxels(Voxels &vox) {
-    vector3df up = norm.crossProduct(right);
+    vec3 up = norm.crossProduct(right);
 
     for (int i = -1 * (width/2/vox.size) - 1; i <= width/2/vox.size; i++) {
       for (int j = -1 * (height/2/vox.size) -1; j <= height/2/vox.size; j++) {
 
-        int cx = pos.X + up.X*i*vox.size + right.X*j*vox.size;
-        int cy = pos.Y + up.Y*i*vox.size + right.Y*j*vox.size;
-        int cz = pos.Z + up.Z*i*vox.size + right.Z*j*vox.size;
-
-        int xi = (int)((cx-vox.xbase)/vox.size);
-        int yi = (int)((cy-vox.ybase)/vox.size);
-        int zi = (int)((cz-vox.zbase)/vox.size);
-
-        vector3di check = vector3di(xi,yi,zi);
+        ivec3 c = vox.cellOf(pos + up*(i*vox.size) + right*(j*vox.size));
+        ivec3 check = c;
 
         for (int dx = -1; dx <= 1; dx++) {
           for (int dy = -1; dy <= 1; dy++) {
             for (int dz = -1; dz <= 1; dz++) {
-              check.X = xi + dx;
-              check.Y = yi + dy;
-              check.Z = zi + dz;
+              check.X = c.X + dx;
+              check.Y = c.Y + dy;
+              check.Z = c.Z + dz;
 
               // Planes don't collide with each other so we only fill in voxels
-              // when it would cause a collision
-              if (vox.voxels[check].size() > 0) {
-                vox.voxels[check].push_back(this);
+              // when it would cause a collision, and only once per cell
+              Voxels::Cell *cell = vox.find(check);
+              if (cell && cell->size() > 0 && cell->back() != this) {
+                cell->push_back(this);
               }
             }
           }
@@ -171,67 +351,97 @@ struct Plane : CollObj {
       }
     }
   }
+};
 
-  void addToScene(irr::scene::ISceneManager *smgr) {
-    vector3df up = norm.crossProduct(right);
-
-    double size = PART_D/2;
-
-    for (int i = -1 * (width/2/size) - 1; i <= width/2/size; i++) {
-      for (int j = -1 * (height/2/size) -1; j <= height/2/size; j++) {
-        double cx = pos.X/size + up.X*i + right.X*j;
-        double cy = pos.Y/size + up.Y*i + right.Y*j;
-        double cz = pos.Z/size + up.Z*i + right.Z*j;
-
-        cx *= size;
-        cy *= size;
-        cz *= size;
 
-        smgr->addSphereSceneNode(PART_D/4)->setPosition(vector3df(cx,cy,cz));
-      }
-    }
-  }
+#ifdef RV_COMPACT
+// Part offsets are stored in steps of LOC_STEP, so must lie within
+// 32767*LOC_STEP (32 units) of the body center on each axis
+#define LOC_STEP (PART_D/512)
+struct Loc {
+  int16_t X, Y, Z;
 };
-
+#endif
 
 struct Obj {
   vector<Particle*> parts;
-  vector< vector3df > locs;
+#ifdef RV_COMPACT
+  vector<Loc> locs;
+#else
+  vector< vec3 > locs;
+#endif
 
-  vector3df pos; // Linear pos
-  vector3df v; // Linear velocity
-  quaternion theta; // Angular pos
-  vector3df w; // Angular velocity
+  vec3 pos; // Linear pos
+  vec3 v; // Linear velocity
+  quat theta; // Angular pos
+  vec3 w; // Angular velocity
 
-  vector3df f; // Step force
-  vector3df t; // Torque
+  vec3 f; // Step force
+  vec3 t; // Torque
 
   bool fixed = false;
+  int id = 0; // Stable index, survives moving between domains
+  real radius = 0; // Bounding sphere about pos, including particle size
+
+  Obj() {}
+  Obj(const Obj&) = delete;
+  Obj& operator=(const Obj&) = delete;
+  ~Obj() {
+    for (int i = poolSize; i < parts.size(); ++i) delete parts[i];
+    delete[] pool;
+  }
+
+  // Offset of part i from pos, before rotation
+  vec3 loc(int i) const {
+#ifdef RV_COMPACT
+    return vec3(locs[i].X, locs[i].Y, locs[i].Z) * LOC_STEP;
+#else
+    return locs[i];
+#endif
+  }
 
   // Integrate steps
-  void integrateForce(double ts) {
+  void integrateForce(real ts) {
     if (fixed) return;
     //cout << "Integrating force " << f << "; " << t << endl;
     v += f*ts;
     w += t*ts;
   }
 
-  void integrateVel(double ts) {
+  void integrateVel(real ts) {
     if (fixed) return;
     pos += v*ts;
     // Compose quaterion for current rotation with new rotation
-    vector3df dtheta = w*ts;
-    double angle = dtheta.getLength();
+    vec3 dtheta = w*ts;
+    real angle = dtheta.getLength();
     dtheta.normalize();
-    quaternion dthetaq;
-    dthetaq.fromAngleAxis((float)angle, dtheta);
+    quat dthetaq;
+    dthetaq.fromAngleAxis(angle, dtheta);
     theta = dthetaq*theta;
   }
 
   // Clear between steps
   void clearStepVals() {
-    f = vector3df(0,0,0);
-    t = vector3df(0,0,0);
+    f = vec3(0,0,0);
+    t = vec3(0,0,0);
+  }
+
+  // Rotate an offset in the body frame, as locs are, into the world frame
+  vec3 toWorld(const vec3 &l) const {
+    quat lq(l.X, l.Y, l.Z, 0);
+    quat thetaInv = theta;
+    thetaInv.makeInverse();
+    lq = thetaInv*lq*theta;
+    return vec3(lq.X, lq.Y, lq.Z);
+  }
+
+  // Rotate a world frame offset into the body frame
+  vec3 toLocal(const vec3 &d) const {
+    quat dq(d.X, d.Y, d.Z, 0);
+    quat thetaInv = theta;
+    thetaInv.makeInverse();
+    dq = theta*dq*thetaInv;
+    return vec3(dq.X, dq.Y, dq.Z);
   }
 
   // Push velocities/positions into parts
@@ -239,51 +449,125 @@ struct Obj {
     assert(locs.size() == parts.size());
     for (int i = 0; i < locs.size(); ++i) {
       Particle *p = parts[i];
-      vector3df loc = locs[i];
-      quaternion rlocq(loc.X, loc.Y, loc.Z, 0);
-      quaternion thetaInv = theta;
-      thetaInv.makeInverse();
-      rlocq = thetaInv*rlocq*theta;
-      vector3df rloc(rlocq.X, rlocq.Y, rlocq.Z);
+      vec3 rloc = toWorld(loc(i));
       p->pos =pos + rloc;
 
+#ifndef RV_COMPACT
       p->v = v;
       if (w.getLengthSQ() > 0.0) {
-        vector3df tangent = w.crossProduct(rloc);
+        vec3 tangent = w.crossProduct(rloc);
         tangent.normalize();
-        vector3df norm = rloc - rloc.dotProduct(w)*w / w.getLengthSQ();
+        vec3 norm = rloc - rloc.dotProduct(w)*w / w.getLengthSQ();
         p->v += norm.getLength() * w.getLength() * tangent;
       }
+#endif
     }
   }
 
   void dumpIntoVoxels(Voxels &v) {
     for (Particle *p : parts) {
-      int xi = (int)((p->pos.X-v.xbase) / v.size);
-      int yi = (int)((p->pos.Y-v.ybase) / v.size);
-      int zi = (int)((p->pos.Z-v.zbase) / v.size);
-      // assert(xi < SIZE);
-      // assert(yi < SIZE);
-      // assert(zi < SIZE);
-      v.voxels[vector3di(xi,yi,zi)].push_back(p);
+      v.insert(v.cellOf(p->pos), p);
       //cout << "Dumped part into : " << xi << "," << yi << "," << zi << endl;
     }
   }
 
-  void addPart(vector3df l) {
-    Particle *p = new Particle();
+  // Only bin particles whose cell lies in one of the given regions
+  void dumpIntoVoxels(Voxels &v, const vector<CellBox> &regions) {
+    for (Particle *p : parts) {
+      ivec3 c = v.cellOf(p->pos);
+      for (const CellBox &r : regions) {
+        if (r.contains(c)) {
+          v.insert(c, p);
+          break;
+        }
+      }
+    }
+  }
+
+  // Before the first addPart, also allocates the first n parts as one block
+  void reserve(int n) {
+    parts.reserve(n);
+    locs.reserve(n);
+    if (parts.empty() && !pool) {
+      pool = new Particle[n];
+      poolSize = n;
+    }
+  }
+
+  // Whether offset l can be stored; RV_COMPACT builds only hold offsets
+  // within 32767*LOC_STEP of the center on each axis
+  static bool fits(const vec3 &l) {
+#ifdef RV_COMPACT
+    return fabs(l.X) <= 32767*LOC_STEP && fabs(l.Y) <= 32767*LOC_STEP &&
+        fabs(l.Z) <= 32767*LOC_STEP;
+#else
+    return true;
+#endif
+  }
+
+  // Returns false, adding nothing, if l does not fit
+  bool addPart(vec3 l) {
+    if (!fits(l)) {
+      cerr << "Part offset " << l.X << " " << l.Y << " " << l.Z
+           << " out of range" << endl;
+      return false;
+    }
+    int i = parts.size();
+    Particle *p = i < poolSize ? &pool[i] : new Particle();
     p->parent = this;
-    p->index = locs.size();
+    p->index = i;
     parts.push_back(p);
+#ifdef RV_COMPACT
+    locs.push_back({(int16_t)lround(l.X / LOC_STEP),
+                    (int16_t)lround(l.Y / LOC_STEP),
+                    (int16_t)lround(l.Z / LOC_STEP)});
+    l = loc(i);
+#else
     locs.push_back(l);
+#endif
+    radius = max(radius, l.getLength() + PART_D/2);
+    return true;
   }
 
-  void draw(double z, void (*pt)(double,double,double),
-            void (*ln)(double,double,double,double,double,double)) {
-    for (Particle *p : parts) {
-      p->draw(z, pt, ln);
+  // Bytes held by this body and its parts, not counting allocator overhead
+  size_t bodyBytes() const {
+    return sizeof(Obj);
+  }
+  size_t partBytes() const {
+    size_t unpooled = max(0, (int)parts.size() - poolSize);
+    return (poolSize + unpooled)*sizeof(Particle) +
+        parts.capacity()*sizeof(Particle*) +
+        locs.capacity()*sizeof(locs[0]);
+  }
+
+  // Points at each part, and lines back to where they were when trail was
+  // last drawn. The caller keeps trail, starting empty.
+  void draw(vector<vec3> &trail, double z,
+            void (*pt)(double,double,double),
+            void (*ln)(double,double,double,double,double,double)) const {
+    bool first = trail.empty();
+    trail.resize(parts.size());
+    for (int i = 0; i < parts.size(); ++i) {
+      const vec3 &p = parts[i]->pos;
+      pt(p.X, p.Y, p.Z);
+      if (!first) {
+        ln(p.X,p.Y,p.Z,trail[i].X,trail[i].Y,trail[i].Z);
+      }
+      trail[i] = p;
     }
   }
+
+private:
+  Particle *pool = nullptr; // Backs parts[0, poolSize)
+  int poolSize = 0;
 };
 
+inline vec3 Particle::vel() const {
+#ifdef RV_COMPACT
+  return parent->v + parent->w.crossProduct(pos - parent->pos);
+#else
+  return v;
+#endif
+}
+
 #endif
@@ -1,11 +1,16 @@
 #include "util.h"
 
-ostream& operator<<(ostream& os, vector3df v) {
+ostream& operator<<(ostream& os, vec3 v) {
   os << "(" << v.X << "," << v.Y << "," << v.Z << ")";
   return os;
 }
 
-ostream& operator<<(ostream& os, vector3di v) {
+ostream& operator<<(ostream& os, quat q) {
+  os << "(" << q.X << "," << q.Y << "," << q.Z << "," << q.W << ")";
+  return os;
+}
+
+ostream& operator<<(ostream& os, ivec3 v) {
   os << "(" << v.X << "," << v.Y << "," << v.Z << ")";
   return os;
 }
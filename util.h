@@ -1,13 +1,14 @@
 #ifndef UTIL_H
 #define UTIL_H
 
-#include <irrlicht/irrlicht.h>
 #include <iostream>
 
+#include "rvmath.h"
+
 using namespace std;
-using namespace irr::core;
 
-ostream& operator<<(ostream& os, vector3df v);
-ostream& operator<<(ostream& os, vector3di v);
+ostream& operator<<(ostream& os, vec3 v);
+ostream& operator<<(ostream& os, quat q);
+ostream& operator<<(ostream& os, ivec3 v);
 
 #endif
@@ -0,0 +1,652 @@
+#include "world.h"
+#include "query.h"
+#include "domain.h"
+
+namespace {
+
+// World space bounds of a body or plane
+struct Bounds {
+  vec3 lo, hi;
+  int body; // Index into the large bodies, or -1 for a plane
+};
+
+bool overlaps(const Bounds &a, const Bounds &b) {
+  return a.lo.X <= b.hi.X && b.lo.X <= a.hi.X &&
+      a.lo.Y <= b.hi.Y && b.lo.Y <= a.hi.Y &&
+      a.lo.Z <= b.hi.Z && b.lo.Z <= a.hi.Z;
+}
+
+// Bounding volume hierarchy over bounds, rebuilt every step by median split
+// along the longest axis
+struct BVH {
+  struct Node {
+    Bounds box;
+    int left, right; // Children, or -1 for a leaf
+    int begin, end; // Range of leaf entries
+  };
+  vector<Bounds> &items;
+  vector<Node> nodes;
+
+  BVH(vector<Bounds> &items) : items(items) {
+    if (!items.empty()) build(0, items.size());
+  }
+
+  int build(int begin, int end) {
+    Node n;
+    n.box = items[begin];
+    for (int i = begin+1; i < end; ++i) {
+      const Bounds &b = items[i];
+      n.box.lo = vec3(min(n.box.lo.X, b.lo.X), min(n.box.lo.Y, b.lo.Y),
+                      min(n.box.lo.Z, b.lo.Z));
+      n.box.hi = vec3(max(n.box.hi.X, b.hi.X), max(n.box.hi.Y, b.hi.Y),
+                      max(n.box.hi.Z, b.hi.Z));
+    }
+    n.left = n.right = -1;
+    n.begin = begin;
+    n.end = end;
+    int id = nodes.size();
+    nodes.push_back(n);
+    if (end - begin <= 4) return id;
+
+    vec3 ext = n.box.hi - n.box.lo;
+    int axis = ext.X > ext.Y ? (ext.X > ext.Z ? 0 : 2)
+                             : (ext.Y > ext.Z ? 1 : 2);
+    int mid = (begin + end) / 2;
+    nth_element(items.begin() + begin, items.begin() + mid,
+                items.begin() + end, [axis](const Bounds &a, const Bounds &b) {
+      if (axis == 0) return a.lo.X + a.hi.X < b.lo.X + b.hi.X;
+      if (axis == 1) return a.lo.Y + a.hi.Y < b.lo.Y + b.hi.Y;
+      return a.lo.Z + a.hi.Z < b.lo.Z + b.hi.Z;
+    });
+    int left = build(begin, mid);
+    int right = build(mid, end);
+    nodes[id].left = left;
+    nodes[id].right = right;
+    return id;
+  }
+
+  // Call f(j) for every entry j overlapping q, with j > after
+  template<class F> void overlapping(const Bounds &q, int after, F f,
+                                     int node = 0) const {
+    if (nodes.empty()) return;
+    const Node &n = nodes[node];
+    if (n.end <= after+1 || !overlaps(n.box, q)) return;
+    if (n.left < 0) {
+      for (int j = max(n.begin, after+1); j < n.end; ++j) {
+        if (overlaps(q, items[j])) f(j);
+      }
+      return;
+    }
+    overlapping(q, after, f, n.left);
+    overlapping(q, after, f, n.right);
+  }
+};
+
+// Bodies with fewer particles are always binned whole, since bounding them
+// costs about as much as binning them
+const int CULL_MIN_PARTS = 32;
+
+// Bodies whose particles may move further than this in one step are swept
+// for contacts, and substepped so no particle moves more than
+// CCD_SUBSTEP_TRAVEL at a time
+const real CCD_MIN_TRAVEL = PART_D/2;
+const real CCD_SUBSTEP_TRAVEL = PART_D/4;
+const int CCD_MAX_SUBSTEPS = 64;
+
+// Furthest any particle of o moves in a step of ts at its current velocity
+real travel(const Obj *o, real ts) {
+  return (o->v.getLength() + o->w.getLength()*o->radius) * ts;
+}
+
+bool fast(const Obj *o, real ts) {
+  return !o->fixed && travel(o, ts) >= CCD_MIN_TRAVEL;
+}
+
+// Whether p is within the cells Plane::dumpIntoVoxels fills, ignoring depth
+bool overPlane(const Plane *pl, const vec3 &p, real cell) {
+  vec3 right = pl->right;
+  right.normalize();
+  vec3 up = pl->norm.crossProduct(pl->right);
+  up.normalize();
+  vec3 off = p - pl->pos;
+  return fabs(off.dotProduct(up)) <= pl->width/2 + 2*cell &&
+      fabs(off.dotProduct(right)) <= pl->height/2 + 2*cell;
+}
+
+} // anonymous namespace
+
+// Midphase: find every pair of overlapping bounds that involves a large
+// body, using a BVH over the large bodies. Large bodies then bin only
+// particles in cells within two of a partner's bounds. That keeps the
+// occupancy of every cell near a possible contact exactly as if all
+// particles were binned, so the contacts found do not change. Fills regions
+// for each body in large.
+void World::midphase(vector<int> &large, vector< vector<CellBox> > &regions) {
+  // With ccd, bounds cover the whole step's motion so sweeps see every
+  // particle they could hit
+  auto boundsOf = [this](int i, const Obj *o) {
+    real reach = o->radius + (ccd ? travel(o, ts) : 0);
+    vec3 r(reach, reach, reach);
+    return Bounds{o->pos - r, o->pos + r, i};
+  };
+  vector<Bounds> bounds;
+  for (int i = 0; i < objects.size(); ++i) {
+    if (objects[i]->parts.size() < CULL_MIN_PARTS) continue;
+    bounds.push_back(boundsOf(large.size(), objects[i]));
+    large.push_back(i);
+  }
+  regions.resize(large.size());
+  if (large.empty()) return;
+
+  // Reorders bounds
+  BVH bvh(bounds);
+  auto region = [this](const Bounds &b) {
+    ivec3 lo = vox.cellOf(b.lo), hi = vox.cellOf(b.hi);
+    return CellBox{ivec3(lo.X-2, lo.Y-2, lo.Z-2),
+                   ivec3(hi.X+2, hi.Y+2, hi.Z+2)};
+  };
+  // Large bodies against each other
+  for (int i = 0; i < bounds.size(); ++i) {
+    const Bounds &a = bounds[i];
+    bvh.overlapping(a, i, [&](int j) {
+      regions[a.body].push_back(region(bounds[j]));
+      regions[bounds[j].body].push_back(region(a));
+    });
+  }
+  // Planes against large bodies
+  for (Plane *p : planes) {
+    // Plane::dumpIntoVoxels samples one cell past each edge, then fills the
+    // cells around each sample's cell, up to two cells away
+    vec3 up = p->norm.crossProduct(p->right);
+    real eu = p->width/2 + vox.size;
+    real er = p->height/2 + vox.size;
+    real pad = 2*vox.size;
+    vec3 half(fabs(up.X)*eu + fabs(p->right.X)*er + pad,
+              fabs(up.Y)*eu + fabs(p->right.Y)*er + pad,
+              fabs(up.Z)*eu + fabs(p->right.Z)*er + pad);
+    Bounds a{p->pos - half, p->pos + half, -1};
+    bvh.overlapping(a, -1, [&](int j) {
+      regions[bounds[j].body].push_back(region(a));
+    });
+  }
+  // Small bodies against large ones
+  for (int i = 0; i < objects.size(); ++i) {
+    if (objects[i]->parts.size() >= CULL_MIN_PARTS) continue;
+    Bounds a = boundsOf(-1, objects[i]);
+    bvh.overlapping(a, -1, [&](int j) {
+      regions[bounds[j].body].push_back(region(a));
+    });
+  }
+
+  // Binning a superset is still exact, so merge long region lists
+  for (vector<CellBox> &rs : regions) {
+    if (rs.size() <= 8) continue;
+    CellBox u = rs[0];
+    for (const CellBox &r : rs) {
+      u.lo = ivec3(min(u.lo.X, r.lo.X), min(u.lo.Y, r.lo.Y),
+                   min(u.lo.Z, r.lo.Z));
+      u.hi = ivec3(max(u.hi.X, r.hi.X), max(u.hi.Y, r.hi.Y),
+                   max(u.hi.Z, r.hi.Z));
+    }
+    rs.assign(1, u);
+  }
+}
+
+void World::bin(bool cull) {
+  vox.clear();
+
+  if (cull) {
+    vector<int> large;
+    vector< vector<CellBox> > regions;
+    midphase(large, regions);
+    // Large bodies that touch nothing are not binned, nor pushed unless
+    // they will be swept
+    int next = 0;
+    for (int i = 0; i < objects.size(); ++i) {
+      Obj *o = objects[i];
+      if (next < large.size() && large[next] == i) {
+        if (!regions[next].empty()) {
+          o->push();
+          o->dumpIntoVoxels(vox, regions[next]);
+        }
+        else if (ccd && fast(o, ts)) {
+          o->push();
+        }
+        ++next;
+        continue;
+      }
+      o->push();
+      o->dumpIntoVoxels(vox);
+    }
+    for (Plane* p : planes) {
+      p->dumpIntoVoxels(vox);
+    }
+    return;
+  }
+
+  // Push obj state into particles
+  for (Obj* o : objects) {
+    o->push();
+  }
+
+  // Run through particles and stick into voxels
+  for (Obj* o : objects) {
+    o->dumpIntoVoxels(vox);
+  }
+
+  for (Plane* p : planes) {
+    p->dumpIntoVoxels(vox);
+  }
+}
+
+int World::bond(const Joint &proto, real reach, Obj *a, Obj *b) {
+  for (int i = 0; i < objects.size(); ++i) {
+    objects[i]->id = i;
+  }
+  bin();
+  reach = min(reach, vox.size);
+  int n = 0;
+  for (Obj *o : objects) {
+    if (a && o != a && o != b) continue;
+    for (int pi = 0; pi < o->parts.size(); ++pi) {
+      Particle *p = o->parts[pi];
+      ivec3 c = vox.cellOf(p->pos);
+      for (int dx = -1; dx <= 1; dx++) {
+        for (int dy = -1; dy <= 1; dy++) {
+          for (int dz = -1; dz <= 1; dz++) {
+            Voxels::Cell *cell = vox.find(ivec3(c.X+dx, c.Y+dy, c.Z+dz));
+            if (!cell) continue;
+            for (CollObj *q : *cell) {
+              if (q->getType() != PART) continue;
+              Particle *pq = (Particle*)q;
+              // Each pair once, from the body listed first
+              if (pq->parent->id <= o->id) continue;
+              if (a && pq->parent != (o == a ? b : a)) continue;
+              if ((pq->pos - p->pos).getLength() > reach) continue;
+              Joint j = Joint::bond(o, pi, pq->parent, pq->index,
+                                    proto.breakForce);
+              j.k = proto.k;
+              j.eta = proto.eta;
+              joints.add(j);
+              ++n;
+            }
+          }
+        }
+      }
+    }
+  }
+  return n;
+}
+
+Footprint World::footprint() const {
+  Footprint fp;
+  fp.bodies = objects.size();
+  for (const Obj *o : objects) {
+    fp.parts += o->parts.size();
+    fp.bodyBytes += o->bodyBytes();
+    fp.partBytes += o->partBytes();
+  }
+  fp.gridBytes = vox.bytes();
+  fp.sceneBytes = sizeof(World) + objects.capacity()*sizeof(Obj*) +
+      planes.capacity()*sizeof(Plane*) + planes.size()*sizeof(Plane) +
+      joints.bytes();
+  return fp;
+}
+
+World::World() {}
+
+World::~World() {
+  decomp.reset();
+  for (Obj *o : objects) delete o;
+  for (Plane *p : planes) delete p;
+}
+
+void World::step() {
+  if (ranks > 1 && !ccd && joints.joints.empty()) {
+    if (!decomp || decomp->nranks != ranks || decomp->lo != slabLo ||
+        decomp->width != slabWidth) {
+      decomp.reset(new Decomposition(ranks, slabLo, slabWidth));
+    }
+    decomp->step(*this);
+    return;
+  }
+  if (ranks > 1 && !rejectedRanks) {
+    cerr << "Decomposed steps support neither CCD nor joints, stepping "
+         << "without ranks; set ccd = false and drop the joints to use them"
+         << endl;
+    rejectedRanks = true;
+  }
+  // With no bodies there is nothing to overlap
+  if (threads > 1 && !objects.empty()) {
+    startStep();
+    stepPipelined();
+    return;
+  }
+  stepForces();
+
+  // Steps 6-7: Integrate forces and velocities
+  integrate(toi, 0, objects.size());
+}
+
+// Step 0: Init objs. Ids follow list order, they fix the order forces are
+// summed in.
+void World::startStep() {
+  for (int i = 0; i < objects.size(); ++i) {
+    objects[i]->id = i;
+    objects[i]->clearStepVals();
+    objects[i]->f = gravity;
+  }
+  for (int i = 0; i < planes.size(); ++i) {
+    planes[i]->id = i;
+  }
+}
+
+void World::stepForces() {
+  startStep();
+
+  // Steps 1-2: Push obj state into particles and bin the ones that may touch
+  bin(true);
+
+  // Step 3: Find fast bodies about to touch something. They leave the
+  // regular pass below and integrate themselves in substeps.
+  toi.assign(objects.size(), 1);
+  bool anySub = ccd && sweep(toi, 0, objects.size());
+
+  // Step 4: Detect collisions, compute forces, add these to objects
+  vector<Collision> cs;
+  vox.findCollisions(cs);
+  contact(cs, toi, anySub);
+
+  // Step 5: Joints, then substeps, which leave their reaction forces on
+  // other bodies
+  joints.apply();
+  if (anySub) substeps(toi);
+}
+
+// The same stages as step, as a task graph over chunks of bodies and slices
+// of the grid. Grid inserts still happen in body order, one chunk after the
+// other, so cells fill exactly as in step; only the pushing, the cell
+// lookups and the reads of the grid run in parallel.
+void World::stepPipelined() {
+  if (!pool || pool->size() != threads) pool.reset(new TaskPool(threads));
+  vox.clear();
+
+  // Chunks of roughly equal particle count
+  int nchunks = min((int)objects.size(), threads*4);
+  vector<int> bounds(1, 0);
+  size_t nparts = 0;
+  for (Obj *o : objects) nparts += o->parts.size();
+  size_t acc = 0;
+  for (int i = 0; i < objects.size(); ++i) {
+    acc += objects[i]->parts.size();
+    if (acc * nchunks >= nparts * bounds.size() && bounds.size() < nchunks) {
+      bounds.push_back(i+1);
+    }
+  }
+  if (bounds.back() != objects.size()) bounds.push_back(objects.size());
+  nchunks = bounds.size() - 1;
+
+  TaskGraph g;
+  vector<int> large;
+  vector< vector<CellBox> > regions;
+  int mid = g.add([&] { midphase(large, regions); });
+
+  // Push each chunk and look up its particles' cells, then insert them, in
+  // chunk order, while later chunks are still being pushed
+  typedef pair<ivec3, Particle*> Binned;
+  vector< vector<Binned> > binned(nchunks);
+  int insert = -1;
+  for (int c = 0; c < nchunks; ++c) {
+    int push = g.add([&, c] {
+      int next = lower_bound(large.begin(), large.end(), bounds[c]) -
+          large.begin();
+      for (int i = bounds[c]; i < bounds[c+1]; ++i) {
+        Obj *o = objects[i];
+        const vector<CellBox> *rs = nullptr;
+        if (next < large.size() && large[next] == i) {
+          rs = &regions[next++];
+          if (rs->empty()) {
+            if (ccd && fast(o, ts)) o->push();
+            continue;
+          }
+        }
+        o->push();
+        for (Particle *p : o->parts) {
+          ivec3 cell = vox.cellOf(p->pos);
+          if (rs && none_of(rs->begin(), rs->end(), [&cell](const CellBox &r) {
+            return r.contains(cell);
+          })) continue;
+          binned[c].push_back(Binned(cell, p));
+        }
+      }
+    }, {mid});
+    vector<int> deps(1, push);
+    if (insert >= 0) deps.push_back(insert);
+    insert = g.add([&, c] {
+      for (const Binned &b : binned[c]) vox.insert(b.first, b.second);
+    }, deps);
+  }
+  vector< pair<uint64_t, Voxels::Brick*> > bricks;
+  int binned_all = g.add([&] {
+    for (Plane *p : planes) {
+      p->dumpIntoVoxels(vox);
+    }
+    bricks.assign(vox.bricks.begin(), vox.bricks.end());
+  }, {insert >= 0 ? insert : mid});
+
+  // Reads of the finished grid: sweeps by chunk, collisions by brick slice
+  toi.assign(objects.size(), 1);
+  vector<char> anySub(nchunks, 0);
+  vector<int> found;
+  for (int c = 0; c < nchunks; ++c) {
+    found.push_back(g.add([&, c] {
+      anySub[c] = ccd && sweep(toi, bounds[c], bounds[c+1]);
+    }, {binned_all}));
+  }
+  int nslices = threads*4;
+  vector< vector<Collision> > slices(nslices);
+  for (int s = 0; s < nslices; ++s) {
+    found.push_back(g.add([&, s] {
+      size_t n = bricks.size();
+      for (size_t i = n*s / nslices; i < n*(s+1) / nslices; ++i) {
+        vox.findCollisions(bricks[i].first, bricks[i].second, slices[s]);
+      }
+    }, {binned_all}));
+  }
+
+  // Contact forces are summed in canonical order, so serially
+  bool any = false;
+  int forces = g.add([&] {
+    vector<Collision> cs;
+    for (vector<Collision> &sl : slices) {
+      cs.insert(cs.end(), sl.begin(), sl.end());
+    }
+    any = find(anySub.begin(), anySub.end(), 1) != anySub.end();
+    contact(cs, toi, any);
+  }, found);
+
+  // Joints color by color, each color split into runs of batches holding
+  // about equal numbers of joints
+  joints.group();
+  for (int c = 0; c < joints.colors(); ++c) {
+    pair<int,int> bs = joints.batchesOf(c);
+    int n = 0;
+    for (int b = bs.first; b < bs.second; ++b) n += joints.batchSize(b);
+    int nruns = min(bs.second - bs.first, threads*4);
+    vector<int> runs;
+    int begin = bs.first, acc = 0;
+    for (int r = 0; r < nruns; ++r) {
+      int end = begin;
+      while (end < bs.second && (r == nruns-1 || acc*nruns < n*(r+1))) {
+        acc += joints.batchSize(end++);
+      }
+      if (end == begin) continue;
+      runs.push_back(g.add([this, begin, end] {
+        joints.apply(begin, end);
+      }, {forces}));
+      begin = end;
+    }
+    forces = g.add([] {}, runs);
+  }
+
+  int subs = g.add([&] { if (any) substeps(toi); }, {forces});
+  for (int c = 0; c < nchunks; ++c) {
+    g.add([&, c] { integrate(toi, bounds[c], bounds[c+1]); }, {subs});
+  }
+
+  pool->run(g);
+}
+
+// Sort collisions canonically and apply them, except those involving bodies
+// that substep
+void World::contact(vector<Collision> &cs, const vector<real> &toi,
+                    bool anySub) {
+  if (anySub) {
+    auto sub = [&toi](CollObj *o) {
+      return o->getType() == PART && toi[((Particle*)o)->parent->id] < 1;
+    };
+    cs.erase(remove_if(cs.begin(), cs.end(), [&sub](const Collision &c) {
+      return sub(c.o1) || sub(c.o2);
+    }), cs.end());
+  }
+  Collision::sortCanonical(cs);
+  for (Collision &c : cs) {
+    c.applyForces(params);
+  }
+}
+
+void World::substeps(const vector<real> &toi) {
+  for (int i = 0; i < objects.size(); ++i) {
+    if (toi[i] < 1) substep(objects[i], toi[i]);
+  }
+}
+
+// Integrate forces then velocities of bodies [begin, end) that did not
+// substep
+void World::integrate(const vector<real> &toi, int begin, int end) {
+  for (int i = begin; i < end; ++i) {
+    if (toi[i] < 1) continue;
+    objects[i]->integrateForce(ts);
+    objects[i]->integrateVel(ts);
+  }
+}
+
+// Continuous collision detection. Sweeps each particle of every fast body
+// along its path for this step through the grid, which holds everything at
+// its start of step position, and against the contact band of each plane.
+// Sets toi to the fraction of the step at which each such body in
+// [begin, end) first makes contact, 0 if it already does. Returns whether any
+// of them will substep.
+bool World::sweep(vector<real> &toi, int begin, int end) {
+  SceneQuery query(*this);
+  bool any = false;
+  for (int i = begin; i < end; ++i) {
+    Obj *o = objects[i];
+    if (!fast(o, ts)) continue;
+
+    real first = 1;
+    for (Particle *p : o->parts) {
+      vec3 d = (o->v + o->w.crossProduct(p->pos - o->pos)) * ts;
+      real len = d.getLength();
+      if (len == 0) continue;
+
+      // Particles, as a sphere of radius PART_D/2 swept past others
+      Ray ray;
+      ray.from = p->pos;
+      ray.dir = d;
+      ray.maxDist = len;
+      ray.radius = PART_D/2;
+      ray.skip = o;
+      RayHit hit = query.raycast(ray);
+      if (hit.part) first = min(first, (real)(hit.dist / len));
+
+      // Planes push on particles within PART_D
+      for (Plane *pl : planes) {
+        vec3 n = pl->norm;
+        n.normalize();
+        real s0 = (p->pos - pl->pos).dotProduct(n);
+        real ds = d.dotProduct(n);
+        real t = 0;
+        if (fabs(s0) >= PART_D) {
+          if (s0*ds >= 0) continue; // Moving away
+          t = (fabs(s0) - PART_D) / fabs(ds);
+          if (t >= 1) continue;
+        }
+        if (overPlane(pl, p->pos + d*t, vox.size)) first = min(first, t);
+      }
+    }
+    if (first < 1) {
+      toi[i] = first;
+      any = true;
+    }
+  }
+  return any;
+}
+
+// Move o freely to toi through the step, then in substeps short enough that
+// no particle travels more than CCD_SUBSTEP_TRAVEL in one, with contacts
+// against planes and the binned particles of other bodies. Those stay where
+// they are, and take the reaction into their own force for this step.
+void World::substep(Obj *o, real toi) {
+  int n = ceil(travel(o, ts)*(1 - toi) / CCD_SUBSTEP_TRAVEL);
+  n = max(1, min(n, CCD_MAX_SUBSTEPS));
+  real dt = (1 - toi)*ts / n;
+  o->integrateVel(toi*ts);
+
+  // Forces left by earlier substepped bodies act over the whole step
+  vec3 f0 = o->f, t0 = o->t;
+  vector<Collision> cs;
+  vector<Obj*> touched;
+  vector<BodyState> before;
+  for (int s = 0; s < n; ++s) {
+    o->push();
+    cs.clear();
+    touched.clear();
+    for (Particle *p : o->parts) {
+      ivec3 c = vox.cellOf(p->pos);
+      for (int dx = -1; dx <= 1; dx++) {
+        for (int dy = -1; dy <= 1; dy++) {
+          for (int dz = -1; dz <= 1; dz++) {
+            Voxels::Cell *cell = vox.find(ivec3(c.X+dx, c.Y+dy, c.Z+dz));
+            if (!cell) continue;
+            for (CollObj *q : *cell) {
+              if (q->getType() != PART) continue;
+              Particle *pq = (Particle*)q;
+              if (pq->parent == o) continue;
+              // Both ways round, as for particles in neighbouring cells
+              cs.push_back({p, q});
+              cs.push_back({q, p});
+              touched.push_back(pq->parent);
+            }
+          }
+        }
+      }
+      for (Plane *pl : planes) {
+        if (overPlane(pl, p->pos, vox.size)) cs.push_back({p, pl});
+      }
+    }
+    Collision::sortCanonical(cs);
+    sort(touched.begin(), touched.end(),
+         [](const Obj *a, const Obj *b) { return a->id < b->id; });
+    touched.erase(unique(touched.begin(), touched.end()), touched.end());
+
+    before.resize(touched.size());
+    for (int j = 0; j < touched.size(); ++j) {
+      before[j].v = touched[j]->f;
+      before[j].w = touched[j]->t;
+    }
+    o->f = f0;
+    o->t = t0;
+    for (Collision &c : cs) {
+      c.applyForces(params);
+    }
+    o->integrateForce(dt);
+    o->integrateVel(dt);
+    // Scale reactions to an average over the step
+    for (int j = 0; j < touched.size(); ++j) {
+      Obj *t = touched[j];
+      t->f = before[j].v + (t->f - before[j].v)*(dt/ts);
+      t->t = before[j].w + (t->t - before[j].w)*(dt/ts);
+    }
+  }
+}
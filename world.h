@@ -0,0 +1,102 @@
+#ifndef WORLD_H
+#define WORLD_H
+
+#include <memory>
+
+#include "types.h"
+#include "taskgraph.h"
+#include "constraint.h"
+
+// Rigid state of one body, as collected from a world
+struct BodyState {
+  vec3 pos;
+  vec3 v;
+  quat theta;
+  vec3 w;
+};
+
+// Bytes held by a world, not counting allocator overhead
+struct Footprint {
+  size_t bodies = 0;
+  size_t parts = 0;
+  size_t bodyBytes = 0; // Obj structs and their per-body arrays
+  size_t partBytes = 0; // Particles, their offsets and pointers to them
+  size_t gridBytes = 0; // Voxel grid, as sized by the last step
+  size_t sceneBytes = 0; // Planes, joints and the lists of bodies and planes
+};
+
+struct Decomposition;
+
+// All state for one simulated scene. Owns its objects and planes.
+struct World {
+  vector<Obj*> objects;
+  vector<Plane*> planes;
+  Voxels vox;
+  Joints joints; // Between objects
+
+  real ts = 0.03;
+  Params params;
+  vec3 gravity; // Acceleration of every body, which all have unit mass
+  bool ccd = true; // Substep fast bodies about to touch something
+  int threads = 1; // Above 1, stages of a step overlap on a thread pool
+  // Above 1, steps split into that many X slabs, slab r covering
+  // [slabLo + r*slabWidth, slabLo + (r+1)*slabWidth), each on its own thread
+  // (see Decomposition). Contact forces then sum in another order, so results
+  // match serial steps to rounding only. Decomposed steps have no CCD or
+  // joints, so with either step reports that once and steps serially.
+  int ranks = 1;
+  double slabLo = 0;
+  double slabWidth = 0;
+
+  World();
+  World(const World&) = delete;
+  World& operator=(const World&) = delete;
+  ~World();
+
+  // Advance all objects by one timestep. Results do not depend on threads.
+  // Large bodies that touch nothing are culled before pushing, so their
+  // particles keep the positions of the last push: anything reading
+  // particle positions afterwards (drawing, queries) must push those bodies
+  // or call bin() first. Body state itself is always current.
+  void step();
+
+  // Push current body state into particles and rebuild the voxel grid. With
+  // cull, large bodies only bin particles near a body or plane whose bounds
+  // overlap their own, which is what step does. Call it without cull before
+  // querying the world.
+  void bin(bool cull = false);
+
+  // Bond every pair of parts of different bodies within reach of each other,
+  // capped at one grid cell, with proto's k, eta and breakForce. Only between
+  // a and b if given. Returns the number of bonds added.
+  int bond(const Joint &proto, real reach, Obj *a = nullptr,
+           Obj *b = nullptr);
+
+  Footprint footprint() const;
+
+  void snapshot(vector<BodyState> &out) const {
+    out.resize(objects.size());
+    for (int i = 0; i < objects.size(); ++i) {
+      const Obj *o = objects[i];
+      out[i] = {o->pos, o->v, o->theta, o->w};
+    }
+  }
+
+private:
+  unique_ptr<TaskPool> pool;
+  vector<real> toi; // Of each body, from the last stepForces
+  unique_ptr<Decomposition> decomp;
+  bool rejectedRanks = false; // Reported that ranks can't be used
+
+  void startStep();
+  void stepForces(); // Every stage of a serial step before integration
+  void stepPipelined();
+  void midphase(vector<int> &large, vector< vector<CellBox> > &regions);
+  bool sweep(vector<real> &toi, int begin, int end);
+  void substep(Obj *o, real toi);
+  void contact(vector<Collision> &cs, const vector<real> &toi, bool anySub);
+  void substeps(const vector<real> &toi);
+  void integrate(const vector<real> &toi, int begin, int end);
+};
+
+#endif